@@ -0,0 +1,76 @@
+#ifndef __CHANGE_RING_H__
+#define __CHANGE_RING_H__
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+/*
+ * ChangeEvent: one committed row change
+ */
+struct ChangeEvent {
+    int op;             // SQLITE_INSERT, SQLITE_UPDATE or SQLITE_DELETE
+    int64_t rowid;
+    char table[48];     // NUL terminated, truncated if longer
+};
+
+/*
+ * ChangeRing: lock-free, single producer, multi consumer broadcast ring
+ *
+ * Every reader sees every event. The producer never waits for readers: once
+ * the ring is full the oldest events get overwritten, and a reader falling
+ * that far behind skips them and accounts them in lost().
+ *
+ * Slots are guarded by a per slot sequence number (seqlock): odd while the
+ * producer writes it, even once the event is complete.
+ */
+class ChangeRing {
+public:
+    /*
+     * capacity is rounded up to the next power of two
+     */
+    ChangeRing(size_t capacity);
+    /*
+     * publish: must not be called concurrently, the wrapper calls it with
+     * the connection lock held
+     */
+    void publish(const ChangeEvent &event);
+
+    class Reader{
+        public:
+            /*
+             * The reader starts at the current head, only the events
+             * published after its creation are seen
+             */
+            Reader(std::shared_ptr<ChangeRing> ring);
+            /*
+             * poll: append up to max events to out, never blocks
+             *
+             * Return the number of events appended
+             */
+            size_t poll(std::vector<ChangeEvent> &out, size_t max = SIZE_MAX);
+            /*
+             * lost: number of events overwritten before this reader could
+             * poll them
+             */
+            uint64_t lost(void) const {
+                return _lost;
+            }
+        private:
+            std::shared_ptr<ChangeRing> ring;
+            uint64_t pos;
+            uint64_t _lost = 0;
+    };
+private:
+    static const size_t slot_words = sizeof(ChangeEvent) / sizeof(uint64_t);
+    struct Slot {
+        std::atomic<uint64_t> seq;
+        std::atomic<uint64_t> data[slot_words];
+    };
+    std::unique_ptr<Slot[]> slots;
+    size_t capacity;
+    std::atomic<uint64_t> head;
+};
+
+#endif
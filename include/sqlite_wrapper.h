@@ -1,17 +1,264 @@
 #ifndef __SQLITE_WRAPPER_H__
 #define __SQLITE_WRAPPER_H__
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
 #include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <set>
+#include <shared_mutex>
 #include <sqlite3.h>
 #include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
 #include <vector>
+#include "change_ring.h"
+#include "sqlite_wrapper_trace.h"
+
+namespace sqlite_wrapper_detail {
+
+/*
+ * Conversions between SQLite values and the C++ types allowed in the
+ * signature of registered functions. A NULL argument converts to 0 or empty.
+ */
+template<typename T> struct arg_of;
+template<> struct arg_of<int> {
+    static int get(sqlite3_value *v) { return sqlite3_value_int(v); }
+};
+template<> struct arg_of<int64_t> {
+    static int64_t get(sqlite3_value *v) { return sqlite3_value_int64(v); }
+};
+template<> struct arg_of<bool> {
+    static bool get(sqlite3_value *v) { return sqlite3_value_int(v) != 0; }
+};
+template<> struct arg_of<double> {
+    static double get(sqlite3_value *v) { return sqlite3_value_double(v); }
+};
+template<> struct arg_of<std::string> {
+    static std::string get(sqlite3_value *v) {
+        auto p = (const char *)sqlite3_value_text(v);
+        return p ? std::string(p, sqlite3_value_bytes(v)) : std::string();
+    }
+};
+template<> struct arg_of<std::vector<uint8_t>> {
+    static std::vector<uint8_t> get(sqlite3_value *v) {
+        auto p = (const uint8_t *)sqlite3_value_blob(v);
+        return p ? std::vector<uint8_t>(p, p + sqlite3_value_bytes(v)) :
+            std::vector<uint8_t>();
+    }
+};
+
+inline void set_result(sqlite3_context *ctx, int r) {
+    sqlite3_result_int(ctx, r);
+}
+inline void set_result(sqlite3_context *ctx, int64_t r) {
+    sqlite3_result_int64(ctx, r);
+}
+inline void set_result(sqlite3_context *ctx, bool r) {
+    sqlite3_result_int(ctx, r ? 1 : 0);
+}
+inline void set_result(sqlite3_context *ctx, double r) {
+    sqlite3_result_double(ctx, r);
+}
+inline void set_result(sqlite3_context *ctx, const std::string &r) {
+    sqlite3_result_text(ctx, r.data(), r.size(), SQLITE_TRANSIENT);
+}
+inline void set_result(sqlite3_context *ctx,
+        const std::vector<uint8_t> &r) {
+    sqlite3_result_blob(ctx, r.data(), r.size(), SQLITE_TRANSIENT);
+}
+
+template<typename T> struct callable_traits :
+    callable_traits<decltype(&T::operator())> {};
+template<typename C, typename R, typename... A>
+struct callable_traits<R (C::*)(A...) const> {
+    typedef R ret;
+    typedef std::tuple<typename std::decay<A>::type...> args;
+};
+template<typename C, typename R, typename... A>
+struct callable_traits<R (C::*)(A...)> : callable_traits<R (C::*)(A...) const> {};
+template<typename R, typename... A>
+struct callable_traits<R (*)(A...)> {
+    typedef R ret;
+    typedef std::tuple<typename std::decay<A>::type...> args;
+};
+
+template<typename F, typename Args, size_t... I>
+auto call_with(F &func, sqlite3_value **argv, std::index_sequence<I...>) ->
+    decltype(func(arg_of<typename std::tuple_element<I, Args>::type>::get(
+                    argv[I])...))
+{
+    return func(arg_of<typename std::tuple_element<I, Args>::type>::get(
+                argv[I])...);
+}
+
+template<typename F>
+struct scalar_function {
+    typedef typename callable_traits<F>::args args;
+    static const int nargs = std::tuple_size<args>::value;
+
+    static void call(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+        auto func = (F *)sqlite3_user_data(ctx);
+
+        (void)argc;
+        try {
+            set_result(ctx, call_with<F, args>(*func, argv,
+                        std::make_index_sequence<nargs>()));
+        } catch (std::exception &e) {
+            sqlite3_result_error(ctx, e.what(), -1);
+        }
+    }
+    static void destroy(void *p) {
+        delete (F *)p;
+    }
+};
+
+/*
+ * The per group state of an aggregate lives on the heap, the aggregate
+ * context of SQLite only keeps a pointer to it.
+ */
+template<typename State, typename Step, typename Final>
+struct aggregate_function {
+    Step step;
+    Final final;
+    typedef typename callable_traits<Step>::args step_args;
+    //the first argument of step is the state
+    static const int nargs = std::tuple_size<step_args>::value - 1;
+
+    template<size_t... I>
+    void do_step(State &state, sqlite3_value **argv,
+            std::index_sequence<I...>) {
+        step(state, arg_of<typename std::tuple_element<I + 1,
+                step_args>::type>::get(argv[I])...);
+    }
+    static void call_step(sqlite3_context *ctx, int argc,
+            sqlite3_value **argv) {
+        auto self = (aggregate_function *)sqlite3_user_data(ctx);
+        auto pstate = (State **)sqlite3_aggregate_context(ctx,
+                sizeof(State *));
+
+        (void)argc;
+        if (pstate == nullptr) {
+            sqlite3_result_error_nomem(ctx);
+            return;
+        }
+        try {
+            if (*pstate == nullptr)
+                *pstate = new State();
+            self->do_step(**pstate, argv, std::make_index_sequence<nargs>());
+        } catch (std::exception &e) {
+            sqlite3_result_error(ctx, e.what(), -1);
+        }
+    }
+    static void call_final(sqlite3_context *ctx) {
+        auto self = (aggregate_function *)sqlite3_user_data(ctx);
+        auto pstate = (State **)sqlite3_aggregate_context(ctx, 0);
+        State *state = (pstate != nullptr) ? *pstate : nullptr;
+        State empty;
+
+        try {
+            set_result(ctx, self->final(state ? *state : empty));
+        } catch (std::exception &e) {
+            sqlite3_result_error(ctx, e.what(), -1);
+        }
+        delete state;
+    }
+    static void destroy(void *p) {
+        delete (aggregate_function *)p;
+    }
+};
+
+}
+
+class IoStatsVfs;
+class FairScheduler;
 
 class SqliteWrapper {
+    class ConnLock;
+    class TraceScope;
 public:
+    /*
+     * LockPolicy: how calls from several threads share the connection
+     *
+     * LOCK_NONE: no locking at all, the connection is opened with
+     * SQLITE_OPEN_NOMUTEX. The owner must confine the wrapper to one thread
+     * at a time; background threads (reaper, maintenance) are refused.
+     *
+     * LOCK_EXCLUSIVE: one call at a time, serialized by the wrapper
+     * scheduler, see SchedPolicy. The connection is opened with
+     * SQLITE_OPEN_NOMUTEX since SQLite never sees concurrent calls.
+     *
+     * LOCK_SHARED: peek_entry, get_entry and cursor pages share the
+     * connection (opened with SQLITE_OPEN_FULLMUTEX), the other calls are
+     * exclusive.
+     */
+    enum LockPolicy {
+        LOCK_NONE = 0,
+        LOCK_EXCLUSIVE,
+        LOCK_SHARED
+    };
+    /*
+     * SchedPolicy: order in which the calls waiting for the connection get
+     * it under LOCK_EXCLUSIVE
+     *
+     * SCHED_ARRIVAL: arrival order, reads and writes alike.
+     *
+     * SCHED_READ_FIRST: waiting reads (peek_entry, get_entry, cursor pages,
+     * count_entries, exists, aggregate) go before waiting writes, up to
+     * Options::read_burst reads in a row while a write waits, or until the
+     * oldest write has waited Options::write_max_wait_ms: then the write
+     * goes next.
+     */
+    enum SchedPolicy {
+        SCHED_ARRIVAL = 0,
+        SCHED_READ_FIRST
+    };
+    /*
+     * Options: settings applied when the database is opened
+     */
+    struct Options {
+        LockPolicy lock_policy = LOCK_EXCLUSIVE;
+        /*
+         * io_stats: open the database through a VFS shim accounting reads,
+         * writes and syncs, see get_io_stats()
+         */
+        bool io_stats = false;
+        /*
+         * plan_warnings: check the query plan of the statements built by
+         * peek_entry, get_entry, update_entry and delete_entry, once per
+         * distinct statement, and warn when a table or index is fully
+         * scanned, see get_full_scans()
+         */
+        bool plan_warnings = false;
+        /*
+         * timeout_ms: default deadline of every call, 0 for none, see
+         * set_default_timeout()
+         */
+        uint32_t timeout_ms = 0;
+        /*
+         * sched_policy, read_burst, write_max_wait_ms: scheduling of the
+         * calls waiting for the connection, see SchedPolicy and
+         * get_sched_stats()
+         */
+        SchedPolicy sched_policy = SCHED_ARRIVAL;
+        uint32_t read_burst = 8;
+        uint32_t write_max_wait_ms = 20;
+        /*
+         * prewarm: tables and indexes to load into the page cache once
+         * opened, before the constructor returns or in the background with
+         * prewarm_background, see prewarm()
+         */
+        std::vector<std::string> prewarm;
+        bool prewarm_background = false;
+    };
 
     SqliteWrapper(const std::string &path);
+    SqliteWrapper(const std::string &path, const Options &options);
     ~SqliteWrapper();
     /*
      * create_table: expects fields part only sql statement:
@@ -24,6 +271,68 @@ public:
      */
     int create_table(const std::string &table_name,
             const std::string &sql_part);
+    /*
+     * ColumnType: declared type of a column. A STRICT table enforces it,
+     * otherwise it only sets the column affinity. COL_NUMERIC is not
+     * allowed in a STRICT table.
+     */
+    enum ColumnType {
+        COL_ANY = 0,
+        COL_INTEGER,
+        COL_REAL,
+        COL_TEXT,
+        COL_BLOB,
+        COL_NUMERIC
+    };
+    /*
+     * TableSchema: typed description of a table and its indexes
+     *
+     * primary_key: key columns, required by without_rowid. An INTEGER
+     * single column key of a rowid table is an alias of the rowid.
+     *
+     * without_rowid: store the rows in the primary key B-tree, no separate
+     * rowid B-tree; blob dedup and change capture need rowid tables.
+     *
+     * strict: reject values not matching the column types
+     */
+    struct TableSchema {
+        struct Column {
+            std::string name;
+            ColumnType type = COL_ANY;
+            bool not_null = false;
+            std::string default_value;  // SQL expression, none if empty
+        };
+        /*
+         * Index: columns are searched in order (COLLATE, ASC and DESC may
+         * follow a name), covering columns are only stored in the index so
+         * queries reading them never touch the table. where makes a partial
+         * index, condition only, without WHERE.
+         *
+         * name defaults to <table>_<columns>_idx.
+         */
+        struct Index {
+            std::vector<std::string> columns;
+            std::vector<std::string> covering;
+            std::string where;
+            bool unique = false;
+            std::string name;
+        };
+        std::string name;
+        std::vector<Column> columns;
+        std::vector<std::string> primary_key;
+        bool without_rowid = false;
+        bool strict = false;
+        std::vector<Index> indexes;
+    };
+    /*
+     * create_table: create the table and indexes of schema, if missing
+     *
+     * Applying the same schema again does nothing; indexes added to the
+     * schema are created. A table or index already existing with another
+     * definition is left untouched and -EEXIST returned, nothing of the
+     * schema is applied then. The call is not traced.
+     */
+    int create_table(const TableSchema &schema);
 
     /*
      * peek_entry: expects condition part only sql statemeent
@@ -33,7 +342,7 @@ public:
      * The function will construct the complete sql statement for querying,
      * like the followling:
      *
-     * "SELECT * from <table_name> WHERE name = xxx AND value = xxx;"
+     * "SELECT 1 from <table_name> WHERE name = xxx AND value = xxx;"
      * 
      */
     bool peek_entry(const std::string &table_name,
@@ -91,6 +400,479 @@ public:
     int delete_entry(const std::string &table_name,
             const std::string &sql_part);
     int delete_all_entry(const std::string &table_name);
+    /*
+     * count_entries: number of rows matching a condition, counted by SQLite
+     *
+     * sql_filter: same as peek_entry, e.g.: "WHERE name = xxx", empty for
+     * the whole table
+     */
+    int count_entries(int64_t &count, const std::string &table_name,
+            const std::string &sql_filter = "");
+    /*
+     * exists: whether a row matches, stops at the first one
+     *
+     * Same as peek_entry, but errors are told apart: return 1 if a row
+     * matches, 0 if none, a negative error otherwise.
+     */
+    int exists(const std::string &table_name, const std::string &sql_filter);
+    /*
+     * enable_blob_dedup: store bound blobs once, content addressed
+     *
+     * Once enabled, every blob bound through insert_entry, update_entry and
+     * insert_update_entry is hashed and kept in the side table
+     * "__sw_blob_store" with a reference count; the user row only keeps a
+     * small reference to it, tagged so that no user blob passes for one.
+     * get_entry resolves references transparently, delete_entry and
+     * delete_all_entry release the references held by the removed rows.
+     * update_entry only revisits the references of the matched rows when
+     * it binds blobs: a SET part dropping a reference without binding any
+     * blob leaves the stored copy counted.
+     *
+     * Rows must only be removed or rewritten by these calls: writes to a
+     * table declaring ON CONFLICT REPLACE and upserts (ON CONFLICT ... DO
+     * UPDATE) are refused with -ENOTSUP.
+     */
+    int enable_blob_dedup(void);
+    /*
+     * enable_change_capture: publish committed row changes
+     *
+     * Registers the update, commit and rollback hooks of the connection.
+     * Changes are kept pending until their transaction commits, then
+     * published into a lock-free ring of (at least) capacity events. Rolled
+     * back changes are never published. Subscribers read the ring without
+     * taking the wrapper lock; a subscriber too slow to keep up loses the
+     * oldest events, reported by ChangeRing::Reader::lost(), writers are
+     * never blocked.
+     *
+     * Changes to WITHOUT ROWID tables are not reported by SQLite.
+     */
+    int enable_change_capture(size_t capacity = 4096);
+    /*
+     * subscribe_changes: create a reader of the change ring, starting at the
+     * changes committed from now on
+     */
+    int subscribe_changes(std::unique_ptr<ChangeRing::Reader> &reader);
+    /*
+     * set_ttl: expire the rows of a table after ttl_sec
+     *
+     * ts_column: integer column holding the row time, in seconds since epoch
+     *
+     * chunk_rows: max rows deleted per transaction by the reaper
+     *
+     * ttl_sec set to 0 removes the TTL of the table.
+     */
+    int set_ttl(const std::string &table_name, const std::string &ts_column,
+            uint32_t ttl_sec, uint32_t chunk_rows = 500);
+    /*
+     * reap_expired: delete the expired rows of every TTL table
+     *
+     * Rows are deleted by rowid ranges of at most chunk_rows rows, one
+     * transaction per chunk; the wrapper lock is released and the thread
+     * yields between chunks so writers are never held for long.
+     *
+     * Return the number of rows deleted, or a negative error.
+     */
+    int64_t reap_expired(void);
+    /*
+     * start_reaper: run reap_expired every interval_ms in a background thread
+     *
+     * stop_reaper: stop the background thread, also done on destruction
+     */
+    int start_reaper(uint32_t interval_ms = 1000);
+    void stop_reaper(void);
+    /*
+     * MaintenanceConfig: schedule and budgets of the maintenance jobs
+     *
+     * A job set to 0 is disabled. Checkpoints, optimize and vacuum only run
+     * once the wrapper saw no call for idle_ms. An idle checkpoint running
+     * longer than checkpoint_budget_ms (0: no budget), or when a foreground
+     * call waits for the connection, is interrupted and retried later. Once
+     * the WAL reaches checkpoint_hard_frames, the committing call checkpoints
+     * itself, whatever the load.
+     */
+    struct MaintenanceConfig {
+        uint32_t idle_ms = 200;
+        uint32_t checkpoint_min_frames = 256;   // passive WAL checkpoint
+        uint32_t checkpoint_hard_frames = 8192;
+        uint32_t checkpoint_budget_ms = 100;
+        uint32_t optimize_interval_ms = 3600 * 1000;    // PRAGMA optimize
+        uint32_t analysis_limit = 400;
+        uint32_t vacuum_interval_ms = 60 * 1000;    // incremental vacuum
+        uint32_t vacuum_pages_per_step = 64;
+        uint32_t vacuum_max_steps = 16;
+    };
+    /*
+     * start_maintenance: run the maintenance jobs in a background thread
+     *
+     * While running, WAL checkpoints are taken off the foreground commits
+     * and done by the maintenance thread, up to checkpoint_hard_frames. Jobs
+     * only take the connection when it is free and give it back between
+     * steps as soon as a foreground call waits for it.
+     *
+     * stop_maintenance: stop the thread and restore the auto checkpoint
+     * threshold found by start_maintenance, also done on destruction
+     */
+    int start_maintenance(const MaintenanceConfig &config);
+    int start_maintenance(void);
+    void stop_maintenance(void);
+    /*
+     * BackupProgress: state of the running (or last) backup
+     */
+    struct BackupProgress {
+        int remaining = 0;      // pages left to copy
+        int pagecount = 0;      // pages of the database
+        uint32_t restarts = 0;  // copy started over, another connection wrote
+        bool done = false;
+        int result = 0;         // once done, 0 on success
+    };
+    /*
+     * backup_to: copy the database to path while it is in use
+     *
+     * A background thread copies pages_per_step pages at a time with the
+     * SQLite online backup API, holding the wrapper lock only for one step,
+     * then sleeps sleep_between_ms. Changes made through the wrapper are
+     * applied to the copy as they happen; changes of other connections make
+     * the copy start over. progress, if set, is called from the backup
+     * thread after each step and once done.
+     *
+     * The copy is written to a uniquely named file next to path and renamed
+     * to it once complete, path never holds a partial backup.
+     *
+     * Return -EBUSY if a backup is already running, -EINVAL with LOCK_NONE.
+     *
+     * wait_backup: wait for the end of the backup, once its last progress
+     * call returned, and return its result (-ENOENT if none was started,
+     * -ECANCELED if cancelled)
+     *
+     * get_backup_progress: state of the running or last backup
+     *
+     * cancel_backup: stop the running backup, also done on destruction
+     */
+    int backup_to(const std::string &path, uint32_t pages_per_step = 64,
+            uint32_t sleep_between_ms = 10,
+            std::function<void(const BackupProgress &)> progress = nullptr);
+    int wait_backup(void);
+    int get_backup_progress(BackupProgress &progress);
+    void cancel_backup(void);
+    /*
+     * PrewarmProgress: state of the running (or last) prewarm
+     */
+    struct PrewarmProgress {
+        uint32_t objects = 0;       // tables and indexes to load
+        uint32_t objects_done = 0;
+        int64_t pages = 0;          // pages of the objects done
+        bool done = false;
+        int result = 0;             // once done, 0 on success
+    };
+    /*
+     * prewarm: load every page of the given tables and indexes into the
+     * page cache of the connection (or fault them in when mmap is used),
+     * so that the first calls after a restart do not read them one by one
+     *
+     * With readahead the database file (and its WAL) is first handed to
+     * the kernel readahead, so the pages then come from the OS cache
+     * instead of random reads; leave it off when the file is much larger
+     * than the memory. The page cache must be large enough to hold the
+     * pages (PRAGMA cache_size), a warning is logged otherwise.
+     *
+     * The connection is held for one table or index at a time. Pages are
+     * walked through the dbstat virtual table: -ENOTSUP if SQLite is built
+     * without it, -ENOENT for an unknown name.
+     *
+     * start_prewarm: same in a background thread, only taking the
+     * connection while no call waits for it; progress, if set, is called
+     * from that thread after each table or index and once done. -EBUSY if
+     * a prewarm is already running, -EINVAL with LOCK_NONE.
+     *
+     * wait_prewarm: wait for the end of the prewarm, once its last progress
+     * call returned, and return its result (-ENOENT if none was started,
+     * -ECANCELED if cancelled)
+     *
+     * get_prewarm_progress: state of the running or last prewarm
+     *
+     * cancel_prewarm: stop the running prewarm, also done on destruction
+     */
+    int prewarm(const std::vector<std::string> &names, bool readahead = true);
+    int start_prewarm(const std::vector<std::string> &names,
+            bool readahead = true,
+            std::function<void(const PrewarmProgress &)> progress = nullptr);
+    int wait_prewarm(void);
+    int get_prewarm_progress(PrewarmProgress &progress);
+    void cancel_prewarm(void);
+    /*
+     * start_trace: record every public call to a binary trace file
+     *
+     * Each record holds the method, table and sql parts, the size and hash
+     * of the bound blobs, the start time, duration, result and calling
+     * thread, see sqlite_wrapper_trace.h. Cursor pages and background jobs
+     * are not recorded. The trace can be replayed by sqlite_wrapper_replay.
+     *
+     * stop_trace: stop recording and close the trace file
+     */
+    int start_trace(const std::string &path);
+    void stop_trace(void);
+    /*
+     * register_function: expose a C++ callable to SQL as a scalar function
+     *
+     * Argument and return types come from the callable signature, among:
+     * int, int64_t, bool, double, std::string, std::vector<uint8_t>
+     *
+     * e.g.: sw.register_function("is_even", [](int64_t x) {
+     *          return x % 2 == 0;
+     *       });
+     *       then "WHERE is_even(num1)" can be used as a filter
+     *
+     * Functions are deterministic by default, letting SQLite use them in
+     * indexes and factor calls out.
+     */
+    template<typename F>
+    int register_function(const std::string &name, F func,
+            bool deterministic = true) {
+        typedef sqlite_wrapper_detail::scalar_function<F> fn;
+        return __create_function(name, fn::nargs, deterministic,
+                new F(func), fn::call, nullptr, nullptr, fn::destroy);
+    }
+    /*
+     * register_aggregate: expose a C++ aggregate to SQL
+     *
+     * State is default constructed for every group, step(State &, args...)
+     * is called for each row and final(State &) returns the group result.
+     *
+     * e.g.: sw.register_aggregate<int64_t>("odd_count",
+     *          [](int64_t &n, int64_t x) { n += x & 1; },
+     *          [](int64_t &n) { return n; });
+     */
+    template<typename State, typename Step, typename Final>
+    int register_aggregate(const std::string &name, Step step, Final final,
+            bool deterministic = true) {
+        typedef sqlite_wrapper_detail::aggregate_function<State, Step, Final>
+            fn;
+        return __create_function(name, fn::nargs, deterministic,
+                new fn{step, final}, nullptr, fn::call_step, fn::call_final,
+                fn::destroy);
+    }
+    /*
+     * parallel_scan: scan a table on several threads and reduce the rows
+     *
+     * The key range of the table is split in partitions, each one scanned by
+     * its own thread on its own read only connection. All the connections
+     * read the same snapshot: their read transactions start while the
+     * wrapper holds the write lock of the database. Then writers go on in
+     * WAL mode, with a rollback journal they wait for the end of the scan.
+     *
+     * row(Partial &, const std::vector<Value> &) is called for every row of
+     * a partition with the sql_values columns, then reduce(result,
+     * Partial &) merges the partitions into result, in key order. Partial
+     * must be default constructible.
+     *
+     * sql_filter: condition only, without WHERE (may be empty)
+     *
+     * key_column: indexed, non NULL column to split on, e.g.: rowid or the
+     * primary key. Integer keys are split in equal ranges, other keys on
+     * their quantiles.
+     *
+     * partitions: number of threads, 0 for one per core
+     *
+     * Registered functions can be used by sql_values and sql_filter, they
+     * may run on several threads at once. Registering a function waits for
+     * the running scans. Not available for in memory databases, -EINVAL.
+     *
+     * e.g.: int64_t sum = 0;
+     *       sw.parallel_scan(sum, "t", "num1", "",
+     *          [](int64_t &s, const std::vector<SqliteWrapper::Value> &row) {
+     *              s += row[0].i;
+     *          },
+     *          [](int64_t &s, int64_t &part) { s += part; });
+     */
+    template<typename Partial, typename Row, typename Reduce>
+    int parallel_scan(Partial &result, const std::string &table_name,
+            const std::string &sql_values, const std::string &sql_filter,
+            Row row, Reduce reduce, uint32_t partitions = 0,
+            const std::string &key_column = "rowid") {
+        std::vector<Partial> parts;
+        int ret;
+
+        if (partitions == 0)
+            partitions = std::max(1u, std::thread::hardware_concurrency());
+        parts.resize(partitions);
+        ret = __parallel_scan(table_name, sql_values, sql_filter, key_column,
+                partitions, [&parts, &row](uint32_t part,
+                    const std::vector<Value> &values) {
+                    row(parts[part], values);
+                });
+        if (ret != 0)
+            return ret;
+        for (auto &part : parts)
+            reduce(result, part);
+        return 0;
+    }
+    /*
+     * Op: wrapper operations, the I/O they cause is accounted to them
+     */
+    enum Op {
+        OP_OTHER = 0,   // opening, closing, configuration
+        OP_CREATE_TABLE,
+        OP_PEEK_ENTRY,
+        OP_INSERT_ENTRY,
+        OP_UPDATE_ENTRY,
+        OP_INSERT_UPDATE_ENTRY,
+        OP_DELETE_ENTRY,
+        OP_DELETE_ALL_ENTRY,
+        OP_GET_ENTRY,
+        OP_CURSOR,
+        OP_TRANSACTION, // begin, commit, rollback of a Transaction
+        OP_REAPER,
+        OP_MAINTENANCE,
+        OP_WRITE_BACK,  // write-back flushes
+        OP_PARALLEL_SCAN,
+        OP_BACKUP,
+        OP_COUNT_ENTRIES,
+        OP_EXISTS,
+        OP_AGGREGATE,
+        OP_PREWARM,
+        OP_MAX
+    };
+    enum IoFile {
+        IO_FILE_DB = 0,
+        IO_FILE_WAL,
+        IO_FILE_JOURNAL,    // rollback journal
+        IO_FILE_OTHER,      // temporary files, statement journals...
+        IO_FILE_MAX
+    };
+    struct IoCounters {
+        uint64_t reads;
+        uint64_t read_bytes;
+        uint64_t read_ns;
+        uint64_t writes;
+        uint64_t write_bytes;
+        uint64_t write_ns;
+        uint64_t syncs;
+        uint64_t sync_ns;
+    };
+    struct IoStats {
+        IoCounters counters[OP_MAX][IO_FILE_MAX];
+    };
+    /*
+     * get_io_stats: I/O done since open (or the last reset), per operation
+     * and per file type
+     *
+     * Only available if opened with Options::io_stats, -EINVAL otherwise.
+     * Pages read through mmap are not seen by the VFS and not counted.
+     */
+    int get_io_stats(IoStats &stats);
+    void reset_io_stats(void);
+    struct SchedClassStats {
+        uint64_t granted;       // calls given the connection
+        uint64_t wait_ns;       // total time waited for it
+        uint64_t max_wait_ns;
+        uint64_t p50_wait_ns;
+        uint64_t p99_wait_ns;
+        uint32_t queued;        // calls waiting now
+        uint32_t max_queued;
+    };
+    struct SchedStats {
+        SchedClassStats reads;
+        SchedClassStats writes;
+    };
+    /*
+     * get_sched_stats: wait for the connection since open (or the last
+     * reset), for reads and writes apart; percentiles are estimated within
+     * 12.5%
+     *
+     * Only available under LOCK_EXCLUSIVE, -EINVAL otherwise.
+     */
+    int get_sched_stats(SchedStats &stats);
+    void reset_sched_stats(void);
+    /*
+     * get_full_scans: number of full scans reported since open, only
+     * counted with Options::plan_warnings
+     */
+    uint64_t get_full_scans(void) {
+        return full_scans.load(std::memory_order_relaxed);
+    }
+    /*
+     * set_default_timeout: deadline of every call, from its start, 0 for
+     * none
+     *
+     * A statement still running at the deadline is interrupted and the call
+     * returns -ETIMEDOUT (peek_entry returns false); changes of an
+     * interrupted write are rolled back. Inside a Transaction, SQLite rolls
+     * back the whole transaction instead: the Transaction and its nested
+     * ones are then dead, see Transaction. Waiting for the wrapper lock counts
+     * in the deadline, a call getting the lock past it is interrupted as
+     * soon as its statement runs for a while. Background jobs, flushes of
+     * the write-back buffer and the begin and commit of a Transaction have
+     * no deadline.
+     *
+     * get_timeouts: number of calls interrupted since open
+     */
+    void set_default_timeout(uint32_t timeout_ms) {
+        default_timeout_ms.store(timeout_ms, std::memory_order_relaxed);
+    }
+    uint64_t get_timeouts(void) {
+        return timeouts.load(std::memory_order_relaxed);
+    }
+    /*
+     * Timeout: deadline of the calls the current thread makes to sw while
+     * it lives, instead of the default one, 0 for none
+     *
+     * e.g.: {
+     *           SqliteWrapper::Timeout timeout(sw, 20);
+     *           ret = sw.get_entry(out, "t", "num1", "WHERE str1 = 'a'");
+     *       }
+     */
+    class Timeout{
+        public:
+            Timeout(SqliteWrapper &sw, uint32_t timeout_ms);
+            ~Timeout();
+        private:
+            const SqliteWrapper *prev_owner;
+            uint32_t prev_timeout_ms;
+    };
+    /*
+     * AllocatorConfig: process wide allocator of SQLite
+     *
+     * pools: serve the allocations of SQLite from size class pools with
+     * per-thread caches of thread_cache_blocks blocks per class (0 for no
+     * cache) instead of the system malloc
+     *
+     * soft_heap_limit: above it SQLite frees cached pages to stay below,
+     * 0 for none
+     * hard_heap_limit: allocations of SQLite making it exceed the limit
+     * fail, the calls return an error, 0 for none
+     */
+    struct AllocatorConfig {
+        bool pools = true;
+        uint32_t thread_cache_blocks = 64;
+        int64_t soft_heap_limit = 0;
+        int64_t hard_heap_limit = 0;
+    };
+    /*
+     * install_allocator: apply config to every connection of the process
+     *
+     * The pools must be installed before SQLite is initialized, that is
+     * before the first SqliteWrapper is opened (or after sqlite3_shutdown()
+     * once all are closed), -EBUSY otherwise; once installed they stay
+     * for the life of the process. The heap limits can be changed any
+     * time, by a config with the same pools and thread_cache_blocks as
+     * the installed ones, -EBUSY otherwise.
+     */
+    static int install_allocator(const AllocatorConfig &config);
+    /*
+     * MemoryStats: memory of SQLite, process wide
+     *
+     * used: bytes allocated now
+     * high_water: most bytes allocated since start or the last reset
+     * pool_reserved: bytes taken from the system by the pools, 0 without
+     */
+    struct MemoryStats {
+        int64_t used;
+        int64_t high_water;
+        int64_t pool_reserved;
+        int64_t soft_heap_limit;
+        int64_t hard_heap_limit;
+    };
+    static void get_memory_stats(MemoryStats &stats, bool reset_high_water = false);
     class GetItem{
         public:
             void *buf;  // data pointer
@@ -100,6 +882,215 @@ public:
                 std::function<int(const void*, uint32_t)> _ext_copy = nullptr) :
                 buf(buf), len(len), ext_copy(_ext_copy){}
     };
+    /*
+     * Value: a single typed column value, as returned by SQLite
+     */
+    class Value{
+        public:
+            int type = SQLITE_NULL; // SQLITE_INTEGER, SQLITE_FLOAT, ...
+            int64_t i = 0;          // valid if type is integer
+            double d = 0;           // valid if type is float
+            std::vector<uint8_t> bytes; // valid if type is text, blob
+        Value() {}
+        Value(int i) : type(SQLITE_INTEGER), i(i) {}
+        Value(int64_t i) : type(SQLITE_INTEGER), i(i) {}
+        Value(double d) : type(SQLITE_FLOAT), d(d) {}
+        Value(const std::string &s) :
+                type(SQLITE_TEXT), bytes(s.begin(), s.end()) {}
+        Value(const std::vector<uint8_t> &b) : type(SQLITE_BLOB), bytes(b) {}
+    };
+    /*
+     * AggregateFn: aggregates computed by aggregate()
+     */
+    enum AggregateFn {
+        AGG_COUNT = 0,  // non NULL values
+        AGG_MIN,
+        AGG_MAX,
+        AGG_SUM,
+        AGG_MAX_FN
+    };
+    /*
+     * aggregate: compute fn over column of the rows matching sql_filter
+     *
+     * Only the result is decoded, an index holding column (and the filter
+     * columns) is enough to compute it. MIN, MAX and SUM of no rows give a
+     * NULL Value.
+     *
+     * e.g.: sw.aggregate(max_ts, "t", SqliteWrapper::AGG_MAX, "ts",
+     *          "WHERE key > 10");
+     */
+    int aggregate(Value &result, const std::string &table_name, AggregateFn fn,
+            const std::string &column, const std::string &sql_filter = "");
+    /*
+     * WriteBackConfig: flush triggers of a write-back table
+     *
+     * max_keys: flush once that many keys are buffered
+     *
+     * max_delay_ms: flush at most max_delay_ms after the first buffered
+     * update, this is the window of updates lost on a crash
+     */
+    struct WriteBackConfig {
+        uint32_t max_keys = 1024;
+        uint32_t max_delay_ms = 100;
+    };
+    /*
+     * enable_write_back: buffer the updates of a table in memory
+     *
+     * key_column: primary key (or unique column) the updates are keyed by
+     *
+     * put_entry() then only updates the in-memory state of the key, the
+     * latest value of each column wins. A background thread flushes the
+     * buffered keys in a single transaction, as upserts, once a trigger of
+     * config fires. Before any other call on the table (and before a
+     * Transaction begins) the buffered keys are flushed, so SQL always sees
+     * the latest state.
+     *
+     * Not available with LOCK_NONE, -EINVAL.
+     */
+    int enable_write_back(const std::string &table_name,
+            const std::string &key_column, const WriteBackConfig &config);
+    int enable_write_back(const std::string &table_name,
+            const std::string &key_column);
+    /*
+     * put_entry: set columns of the row of key in a write-back table
+     *
+     * The row is inserted if missing, the columns not given keep their
+     * value. Never touches the connection: the call does not wait for the
+     * wrapper lock, even inside a Transaction of another thread. Blobs are
+     * stored as is, without deduplication, and the call is not traced.
+     */
+    int put_entry(const std::string &table_name, const Value &key,
+            const std::map<std::string, Value> &columns);
+    /*
+     * get_key_entry: read columns of the row of key in a write-back table
+     *
+     * Served from memory when every column is buffered, otherwise read from
+     * the database with the buffered columns applied over it.
+     *
+     * Return 0 on success, -ENOENT if the key is neither buffered nor
+     * stored.
+     */
+    int get_key_entry(std::vector<Value> &out, const std::string &table_name,
+            const Value &key, const std::vector<std::string> &columns);
+    /*
+     * flush_write_back: flush the buffered keys of every write-back table
+     * now, also done on destruction
+     */
+    int flush_write_back(void);
+    /*
+     * Cursor: keyset paginated scan over a table
+     *
+     * Rows are fetched page_size at a time, ordered by key_column, each page
+     * starting after the last key seen, so every page costs the same no
+     * matter how deep the scan is. The wrapper lock is only held while a
+     * page is fetched, writers may run between two pages.
+     *
+     * key_column: unique, non NULL column to page by, e.g.: rowid or the
+     * primary key
+     *
+     * sql_values: expect the format: field1, field2, ....
+     *
+     * sql_filter: condition only, without WHERE, e.g.: field1 > 10 (may be
+     * empty)
+     */
+    class Cursor{
+        public:
+            Cursor(SqliteWrapper &sw, const std::string &table_name,
+                    const std::string &sql_values,
+                    const std::string &sql_filter = "",
+                    const std::string &key_column = "rowid",
+                    uint32_t page_size = 256);
+            /*
+             * next: decode the next row into out, same as get_entry
+             *
+             * Return 0 on success, -ENOENT once the scan is exhausted.
+             */
+            int next(std::vector<GetItem> &out);
+        private:
+            int fetch_page(void);
+            SqliteWrapper &sw;
+            std::string table_name;
+            std::string sql_first;  // query for the first page
+            std::string sql_next;   // query for the pages after a key
+            uint32_t page_size;
+            std::vector<std::vector<Value>> rows;   // key first, then values
+            size_t pos = 0;
+            Value last_key;
+            bool started = false;
+            bool eof = false;
+    };
+    /*
+     * Transaction: group several wrapper calls in a single transaction
+     *
+     * The outermost Transaction takes the connection for its whole lifetime
+     * and begins an immediate transaction; a Transaction built from another
+     * one is a nested savepoint of it. commit() makes the changes durable
+     * (released into the parent for a savepoint), a Transaction destroyed
+     * without commit() rolls back.
+     *
+     * While a Transaction lives, the wrapper calls must go through its own
+     * methods, calling the wrapper from the same thread would deadlock.
+     * A Transaction has at most one nested Transaction at a time, which
+     * must end before its parent; a second one is not active (is_ok() is
+     * false).
+     *
+     * A failing call may have SQLite roll back the whole transaction, e.g.
+     * a write interrupted past its deadline: the Transaction and all its
+     * nested ones are then dead. Their calls return -EINVAL (peek_entry
+     * false), is_ok() is false and commit() returns -ECANCELED; they must
+     * still be destroyed, which releases the connection.
+     */
+    class Transaction{
+        public:
+            Transaction(SqliteWrapper &sw);
+            Transaction(Transaction &parent);
+            ~Transaction();
+            int commit(void);
+            int rollback(void);
+            bool is_ok(void) {
+                return active && !dead();
+            }
+            bool peek_entry(const std::string &table_name,
+                    const std::string &sql_part);
+            int insert_entry(const std::string &table_name,
+                    const std::string &sql_part,
+                    std::map<const std::string, std::vector<uint8_t>*> *blobs = nullptr);
+            int update_entry(const std::string &table_name,
+                    const std::string &sql_part_update,
+                    const std::string &sql_part_filter,
+                    std::map<const std::string, std::vector<uint8_t>*> *blobs = nullptr);
+            int insert_update_entry(const std::string &table_name,
+                    const std::string &sql_part_insert,
+                    const std::string &sql_part_update,
+                    const std::string &sql_part_filter,
+                    std::map<const std::string, std::vector<uint8_t>*> *blobs = nullptr);
+            int delete_entry(const std::string &table_name,
+                    const std::string &sql_part);
+            int delete_all_entry(const std::string &table_name);
+            int get_entry(std::vector<GetItem> &out,
+                    const std::string &table_name,
+                    const std::string &sql_values,
+                    const std::string &sql_filter);
+            int count_entries(int64_t &count, const std::string &table_name,
+                    const std::string &sql_filter = "");
+            int exists(const std::string &table_name,
+                    const std::string &sql_filter);
+            int aggregate(Value &result, const std::string &table_name,
+                    AggregateFn fn, const std::string &column,
+                    const std::string &sql_filter = "");
+        private:
+            int end(bool do_commit);
+            bool dead(void);
+            int settle(int ret);
+            SqliteWrapper &sw;
+            Transaction *parent = nullptr;
+            std::unique_ptr<ConnLock> lock;     // outermost only
+            std::string savepoint;              // nested only
+            uint32_t depth = 0;
+            int children = 0;
+            bool active = false;
+            bool rolled_back = false;           // outermost only
+    };
     /*
      * get_entry: get an entry from db
      *
@@ -117,6 +1108,80 @@ public:
         return db_ok;
     }
 private:
+    /*
+     * OpScope: marks the operation the calling thread runs, for the I/O
+     * accounting
+     */
+    class OpScope{
+        public:
+            OpScope(SqliteWrapper *sw, int op);
+            ~OpScope();
+        private:
+            const IoStatsVfs *prev_owner = nullptr;
+            int prev_op = OP_OTHER;
+            bool active = false;
+    };
+    /*
+     * ConnLock: connection lock taken by every call, following the lock
+     * policy. Foreground calls let the maintenance jobs see they have to
+     * yield; background jobs only try to take the lock (try_only).
+     */
+    class ConnLock{
+        public:
+            ConnLock(SqliteWrapper *sw, int op = OP_OTHER,
+                    bool try_only = false);
+            ~ConnLock();
+            bool owns_lock(void) {
+                return owns;
+            }
+            void lock(void);
+            void unlock(void);
+        private:
+            enum {
+                HELD_NONE,
+                HELD_MUTEX,
+                HELD_SHARED_READ,
+                HELD_SHARED_WRITE
+            } mode = HELD_NONE;
+            SqliteWrapper *sw;
+            bool read;
+            OpScope op_scope;
+            bool background;
+            bool owns = false;
+    };
+    /*
+     * Deadline: deadline of a call, checked by the progress handler of the
+     * connection in the thread running the statement
+     */
+    class Deadline{
+        public:
+            Deadline(SqliteWrapper *sw);
+            ~Deadline();
+            /*
+             * result: -ETIMEDOUT if the call was interrupted, ret otherwise
+             */
+            int result(int ret);
+        private:
+            SqliteWrapper *sw;
+            const SqliteWrapper *prev_owner;
+            int64_t prev_deadline_ns;
+            bool prev_expired;
+    };
+    /*
+     * TraceScope: times a public call and records it once done, if tracing
+     */
+    class TraceScope{
+        public:
+            TraceScope(SqliteWrapper *sw, uint8_t method);
+            int done(int result,
+                    std::initializer_list<const std::string *> args,
+                    std::map<const std::string, std::vector<uint8_t>*> *blobs = nullptr,
+                    uint32_t aux = 0);
+        private:
+            std::shared_ptr<TraceWriter> tracer;
+            uint8_t method;
+            uint64_t start_ns = 0;
+    };
     bool __peek_entry(const std::string &table_name,
             const std::string &sql_part);
     int __insert_entry(const std::string &table_name,
@@ -126,18 +1191,184 @@ private:
             const std::string &sql_update,
             const std::string &sql_filter,
             std::map<const std::string, std::vector<uint8_t>*> *blobs = nullptr);
+    int __insert_update_entry(const std::string &table_name,
+            const std::string &sql_part_insert,
+            const std::string &sql_part_update,
+            const std::string &sql_part_filter,
+            std::map<const std::string, std::vector<uint8_t>*> *blobs = nullptr);
     int __delete_entry(const std::string &table_name,
             const std::string &sql_part);
     int __delete_all_entry(const std::string &table_name);
     int __exec_sql_1(const std::string &sql_str,
-            std::map<const std::string, std::vector<uint8_t>*> *blobs = nullptr);
+            std::map<const std::string, std::vector<uint8_t>*> *blobs = nullptr,
+            const std::function<int(sqlite3_stmt *)> &on_row = nullptr);
     int __get_entry(std::vector<GetItem> &out,
             const std::string &table_name,
             const std::string &sql_values,
             const std::string &sql_filter);
+    int __exec(const std::string &sql_str);
+    int __scalar(const std::string &sql_str, Value &result);
+    int __count_entries(int64_t &count, const std::string &table_name,
+            const std::string &sql_filter);
+    int __exists(const std::string &table_name,
+            const std::string &sql_filter);
+    int __aggregate(Value &result, const std::string &table_name,
+            AggregateFn fn, const std::string &column,
+            const std::string &sql_filter);
+    int __apply_schema_sql(const std::string &type, const std::string &name,
+            const std::string &sql_str);
+    void __check_plan(const std::string &sql_str);
+    int __parallel_scan(const std::string &table_name,
+            const std::string &sql_values, const std::string &sql_filter,
+            const std::string &key_column, uint32_t partitions,
+            const std::function<void(uint32_t,
+                const std::vector<Value> &)> &on_row);
+    int __scan_open(const std::string &path, sqlite3 *&conn);
+    int __scan_bounds(sqlite3 *conn, const std::string &table_name,
+            const std::string &key_column, uint32_t partitions,
+            std::vector<Value> &bounds);
+    int __scan_partition(sqlite3 *conn, const std::string &sql_str,
+            const Value *lower, const Value *upper, uint32_t part,
+            const std::function<void(uint32_t,
+                const std::vector<Value> &)> &on_row,
+            std::atomic<bool> &failed);
+    int __create_function(const std::string &name, int nargs,
+            bool deterministic, void *app,
+            void (*func)(sqlite3_context *, int, sqlite3_value **),
+            void (*step)(sqlite3_context *, int, sqlite3_value **),
+            void (*final)(sqlite3_context *),
+            void (*destroy)(void *));
+    int __savepoint(const std::string &name);
+    int __release(const std::string &name);
+    int __rollback_to(const std::string &name);
+    int64_t __reap_chunk(const std::string &table_name,
+            const std::string &ts_column, int64_t cutoff,
+            uint32_t chunk_rows, int64_t &after);
+    int __maint_checkpoint(void);
+    int __maint_optimize(void);
+    int __maint_vacuum(void);
+    int __backup_run(const std::string &path, uint32_t pages_per_step,
+            uint32_t sleep_between_ms,
+            const std::function<void(const BackupProgress &)> &progress);
+    int __prewarm_run(const std::vector<std::string> &names, bool readahead,
+            bool background,
+            const std::function<void(const PrewarmProgress &)> &progress);
+    int __prewarm_object(const std::string &name, int64_t &pages);
+    void __prewarm_readahead(void);
+    void __prewarm_report(const PrewarmProgress &state,
+            const std::function<void(const PrewarmProgress &)> &progress);
+    void __backup_report(const BackupProgress &state,
+            const std::function<void(const BackupProgress &)> &progress);
+    static int deadline_handler(void *arg);
+    static int change_commit_hook(void *arg);
+    static void change_rollback_hook(void *arg);
+    static int wal_frames_hook(void *arg, sqlite3 *db, const char *db_name,
+            int frames);
+    void __preempt_checkpoint(void);
+    void __drop_changes(size_t mark);
+    static int __copy_column(const GetItem &item, int type, int64_t i,
+            double d, const void *data, uint32_t len);
+    int __load_column(sqlite3_stmt *stmt, int idx, Value &value);
+    int __dedup_store_blobs(
+            std::map<const std::string, std::vector<uint8_t>*> &blobs,
+            std::map<const std::string, std::vector<uint8_t>*> &refs,
+            std::vector<std::vector<uint8_t>> &ref_bufs,
+            std::vector<int64_t> &ids);
+    int __dedup_incref(int64_t id, int64_t delta, int64_t tag);
+    int __dedup_adjust_row(sqlite3_stmt *stmt, int first_col, int64_t delta,
+            std::vector<int64_t> &touched);
+    int __dedup_check_write(const std::string &table_name,
+            const std::string &sql_part);
+    int __dedup_release_rows(const std::string &table_name,
+            const std::string &sql_filter, std::vector<int64_t> &touched);
+    int __dedup_gc(const std::vector<int64_t> &ids);
+    int __dedup_resolve(sqlite3 *conn, const void *&data, uint32_t &len,
+            sqlite3_stmt *&res_stmt);
+    struct WbEntry {
+        Value key;
+        std::map<std::string, Value> columns;
+    };
+    struct WbTable {
+        std::string key_column;
+        WriteBackConfig config;
+        std::map<std::string, WbEntry> dirty;   // by encoded key
+        int64_t oldest_ms = 0;  // first update since the last flush
+    };
+    static void __bind_value(sqlite3_stmt *stmt, int idx, const Value &value);
+    int __wb_flush(const std::string &table_name);
+    int __wb_write(const std::string &table_name, const std::string &key_column,
+            const std::map<std::string, WbEntry> &entries);
+    int __open(const std::string &path, const Options &options);
     sqlite3 *db = nullptr;
     bool db_ok = false;
-    std::mutex _mutex;
+    std::unique_ptr<IoStatsVfs> io_vfs;
+    bool blob_dedup = false;
+    std::shared_ptr<ChangeRing> change_ring;
+    std::vector<ChangeEvent> change_pending;    // uncommitted changes
+    std::vector<size_t> savepoint_marks;
+    struct TtlRule {
+        std::string ts_column;
+        uint32_t ttl_sec;
+        uint32_t chunk_rows;
+    };
+    std::map<std::string, TtlRule> ttl_rules;
+    std::thread reaper_thread;
+    std::mutex reaper_mutex;
+    std::condition_variable reaper_cv;
+    bool reaper_stop = false;
+    std::thread maint_thread;
+    std::mutex maint_mutex;
+    std::condition_variable maint_cv;
+    bool maint_stop = false;
+    MaintenanceConfig maint_config;
+    int maint_autocheckpoint = 1000;            // SQLite default
+    std::thread backup_thread;
+    std::mutex backup_mutex;
+    std::condition_variable backup_cv;
+    bool backup_stop = false;
+    bool backup_started = false;
+    BackupProgress backup_state;
+    std::thread prewarm_thread;
+    std::mutex prewarm_mutex;
+    std::condition_variable prewarm_cv;
+    bool prewarm_stop = false;
+    bool prewarm_started = false;
+    PrewarmProgress prewarm_state;
+    std::atomic<int> fg_waiting{0};
+    std::atomic<int64_t> last_activity_ms{0};
+    std::atomic<int> wal_frames{0};
+    std::mutex ckpt_mutex;
+    std::condition_variable ckpt_cv;
+    std::atomic<bool> ckpt_running{false};
+    std::atomic<bool> tracing{false};
+    std::map<std::string, WbTable> wb_tables;
+    std::atomic<bool> write_back{false};
+    std::thread wb_thread;
+    std::mutex wb_mutex;
+    std::condition_variable wb_cv;
+    bool wb_stop = false;
+    std::shared_ptr<TraceWriter> tracer;
+    struct FunctionDef {
+        int nargs;
+        int flags;
+        void *app;
+        void (*func)(sqlite3_context *, int, sqlite3_value **);
+        void (*step)(sqlite3_context *, int, sqlite3_value **);
+        void (*final)(sqlite3_context *);
+    };
+    //registered functions, by name and number of arguments, set again on
+    //the connections of the parallel scans
+    std::map<std::pair<std::string, int>, FunctionDef> functions;
+    std::shared_timed_mutex functions_mutex;
+    bool plan_warnings = false;
+    std::set<std::string> plan_checked;
+    std::mutex plan_mutex;
+    std::atomic<uint64_t> full_scans{0};
+    std::atomic<uint32_t> default_timeout_ms{0};
+    std::atomic<uint64_t> timeouts{0};
+    LockPolicy lock_policy = LOCK_EXCLUSIVE;
+    std::unique_ptr<FairScheduler> scheduler;     // LOCK_EXCLUSIVE
+    std::shared_timed_mutex _shared_mutex;    // LOCK_SHARED
 };
 
 
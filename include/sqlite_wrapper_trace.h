@@ -0,0 +1,91 @@
+#ifndef __SQLITE_WRAPPER_TRACE_H__
+#define __SQLITE_WRAPPER_TRACE_H__
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Workload trace of the SqliteWrapper public calls
+ *
+ * File layout: the 8 bytes magic "SWTRACE1", then one record per call, all
+ * integers in host byte order:
+ *
+ *   u8 method, u32 thread, u32 aux, i32 result, u64 ts_ns, u64 duration_ns,
+ *   u8 nargs, nargs * (u32 len, bytes),
+ *   u16 nblobs, nblobs * (u32 name len, name, u32 size, u64 hash)
+ *
+ * Blob contents are not recorded, only their size and FNV-1a hash.
+ */
+enum TraceMethod {
+    TRACE_CREATE_TABLE = 1,
+    TRACE_PEEK_ENTRY,
+    TRACE_INSERT_ENTRY,
+    TRACE_UPDATE_ENTRY,
+    TRACE_INSERT_UPDATE_ENTRY,
+    TRACE_DELETE_ENTRY,
+    TRACE_DELETE_ALL_ENTRY,
+    TRACE_GET_ENTRY,            // aux: number of output items
+    TRACE_ENABLE_BLOB_DEDUP,
+    TRACE_TX_BEGIN,             // aux: nesting depth, 0 for outermost
+    TRACE_TX_COMMIT,
+    TRACE_TX_ROLLBACK,
+    TRACE_COUNT_ENTRIES,
+    TRACE_EXISTS,
+    TRACE_AGGREGATE,            // aux: aggregate function
+    TRACE_METHOD_MAX
+};
+
+struct TraceBlob {
+    std::string name;
+    uint32_t size;
+    uint64_t hash;
+};
+
+struct TraceRecord {
+    uint8_t method = 0;
+    uint32_t thread = 0;        // small id, in order of first call
+    uint32_t aux = 0;
+    int32_t result = 0;
+    uint64_t ts_ns = 0;         // call start, since the trace start
+    uint64_t duration_ns = 0;   // including the wait for the connection
+    std::vector<std::string> args;  // table name, then sql parts
+    std::vector<TraceBlob> blobs;
+};
+
+class TraceWriter {
+public:
+    ~TraceWriter();
+    int open(const std::string &path);
+    void close(void);
+    uint64_t now_ns(void);
+    int write(TraceRecord &record);
+private:
+    FILE *fp = nullptr;
+    std::mutex _mutex;
+    std::chrono::steady_clock::time_point start;
+    std::map<std::thread::id, uint32_t> threads;
+};
+
+class TraceReader {
+public:
+    ~TraceReader();
+    int open(const std::string &path);
+    /*
+     * read: read the next record
+     *
+     * Return 0 on success, -ENOENT at the end of the trace, -EINVAL if the
+     * trace is truncated or corrupted
+     */
+    int read(TraceRecord &record);
+private:
+    FILE *fp = nullptr;
+    long size = 0;              // file size, bounds the string lengths
+};
+
+#endif
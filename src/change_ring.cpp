@@ -0,0 +1,74 @@
+#include <string.h>
+#include "change_ring.h"
+
+static_assert(sizeof(ChangeEvent) % sizeof(uint64_t) == 0,
+        "ChangeEvent must be made of whole 64 bits words");
+
+ChangeRing::ChangeRing(size_t capacity) : capacity(1), head(0)
+{
+    while (this->capacity < capacity)
+        this->capacity <<= 1;
+    slots.reset(new Slot[this->capacity]);
+    for (size_t i = 0; i < this->capacity; i++)
+        slots[i].seq.store(0, std::memory_order_relaxed);
+}
+
+void ChangeRing::publish(const ChangeEvent &event)
+{
+    uint64_t n = head.load(std::memory_order_relaxed);
+    Slot &slot = slots[n & (capacity - 1)];
+    uint64_t words[slot_words];
+
+    memcpy(words, &event, sizeof(words));
+    slot.seq.store(2 * n + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < slot_words; i++)
+        slot.data[i].store(words[i], std::memory_order_relaxed);
+    slot.seq.store(2 * n + 2, std::memory_order_release);
+    head.store(n + 1, std::memory_order_release);
+}
+
+ChangeRing::Reader::Reader(std::shared_ptr<ChangeRing> ring) : ring(ring)
+{
+    pos = ring->head.load(std::memory_order_acquire);
+}
+
+size_t ChangeRing::Reader::poll(std::vector<ChangeEvent> &out, size_t max)
+{
+    size_t count = 0;
+
+    while (count < max) {
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t words[slot_words];
+        ChangeEvent event;
+
+        if (pos == head)
+            break;
+        if (head - pos > ring->capacity) {
+            _lost += head - pos - ring->capacity;
+            pos = head - ring->capacity;
+        }
+
+        Slot &slot = ring->slots[pos & (ring->capacity - 1)];
+        uint64_t seq = slot.seq.load(std::memory_order_acquire);
+        if (seq != 2 * pos + 2) {
+            //overwritten (or being overwritten), catch up with the head
+            _lost++;
+            pos++;
+            continue;
+        }
+        for (size_t i = 0; i < slot_words; i++)
+            words[i] = slot.data[i].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) != seq) {
+            _lost++;
+            pos++;
+            continue;
+        }
+        memcpy(&event, words, sizeof(event));
+        out.push_back(event);
+        pos++;
+        count++;
+    }
+    return count;
+}
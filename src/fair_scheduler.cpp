@@ -0,0 +1,167 @@
+#include <algorithm>
+#include <chrono>
+#include "fair_scheduler.h"
+
+static uint64_t now_ns(void)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int bucket_of(uint64_t ns)
+{
+    int msb;
+
+    if (ns < 8)
+        return ns;
+    msb = 63 - __builtin_clzll(ns);
+    return msb * 8 + ((ns >> (msb - 3)) & 7);
+}
+
+static uint64_t bucket_max(int bucket)
+{
+    int msb = bucket / 8;
+
+    if (bucket < 8)
+        return bucket;
+    return ((uint64_t)(9 + bucket % 8) << (msb - 3)) - 1;
+}
+
+FairScheduler::FairScheduler(SqliteWrapper::SchedPolicy policy,
+        uint32_t read_burst, uint32_t write_max_wait_ms) :
+    policy(policy), read_burst(read_burst),
+    write_max_wait_ns((uint64_t)write_max_wait_ms * 1000000)
+{
+}
+
+void FairScheduler::account(Queue &queue, uint64_t wait_ns)
+{
+    ++queue.granted;
+    queue.wait_ns += wait_ns;
+    queue.max_wait_ns = std::max(queue.max_wait_ns, wait_ns);
+    ++queue.hist[bucket_of(wait_ns)];
+}
+
+void FairScheduler::lock(bool read)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    Queue &queue = read ? reads : writes;
+    Waiter waiter;
+
+    if (!held && reads.waiters.empty() && writes.waiters.empty()) {
+        held = true;
+        account(queue, 0);
+        return;
+    }
+    waiter.ticket = next_ticket++;
+    waiter.since_ns = now_ns();
+    queue.waiters.push_back(&waiter);
+    queue.max_queued = std::max(queue.max_queued,
+            (uint32_t)queue.waiters.size());
+    waiter.cv.wait(lock, [&waiter] { return waiter.granted; });
+    account(queue, now_ns() - waiter.since_ns);
+}
+
+/*
+ * try_lock: only when nobody holds or waits for the lock, the background
+ * jobs using it must not get ahead of the waiting calls
+ */
+bool FairScheduler::try_lock(void)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (held || !reads.waiters.empty() || !writes.waiters.empty())
+        return false;
+    held = true;
+    return true;
+}
+
+/*
+ * next: pick the waiter the lock goes to, nullptr if none
+ */
+FairScheduler::Waiter *FairScheduler::next(uint64_t now)
+{
+    Waiter *read = reads.waiters.empty() ? nullptr : reads.waiters.front();
+    Waiter *write = writes.waiters.empty() ? nullptr : writes.waiters.front();
+    bool write_next;
+
+    if (write == nullptr) {
+        reads_in_row = 0;
+        if (read != nullptr)
+            reads.waiters.pop_front();
+        return read;
+    }
+    if (read == nullptr)
+        write_next = true;
+    else if (policy == SqliteWrapper::SCHED_READ_FIRST)
+        write_next = reads_in_row >= read_burst ||
+            now - write->since_ns >= write_max_wait_ns;
+    else
+        write_next = write->ticket < read->ticket;
+    if (write_next) {
+        reads_in_row = 0;
+        writes.waiters.pop_front();
+        return write;
+    }
+    ++reads_in_row;
+    reads.waiters.pop_front();
+    return read;
+}
+
+void FairScheduler::unlock(void)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    Waiter *waiter = next(now_ns());
+
+    if (waiter == nullptr) {
+        held = false;
+        return;
+    }
+    /* the lock stays held, handed over to the waiter */
+    waiter->granted = true;
+    waiter->cv.notify_one();
+}
+
+void FairScheduler::fill(const Queue &queue,
+        SqliteWrapper::SchedClassStats &out)
+{
+    uint64_t p50 = (queue.granted + 1) / 2;
+    uint64_t p99 = queue.granted - queue.granted / 100;
+    uint64_t seen = 0;
+    bool p50_found = false;
+
+    out.granted = queue.granted;
+    out.wait_ns = queue.wait_ns;
+    out.max_wait_ns = queue.max_wait_ns;
+    out.p50_wait_ns = out.p99_wait_ns = 0;
+    out.queued = queue.waiters.size();
+    out.max_queued = queue.max_queued;
+    for (int i = 0; i < HIST_BUCKETS && seen < p99; ++i) {
+        seen += queue.hist[i];
+        if (!p50_found && seen >= p50) {
+            out.p50_wait_ns = std::min(bucket_max(i), queue.max_wait_ns);
+            p50_found = true;
+        }
+        if (seen >= p99)
+            out.p99_wait_ns = std::min(bucket_max(i), queue.max_wait_ns);
+    }
+}
+
+void FairScheduler::snapshot(SqliteWrapper::SchedStats &stats)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    fill(reads, stats.reads);
+    fill(writes, stats.writes);
+}
+
+void FairScheduler::reset(void)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    for (Queue *queue : {&reads, &writes}) {
+        queue->granted = queue->wait_ns = queue->max_wait_ns = 0;
+        queue->max_queued = queue->waiters.size();
+        std::fill(queue->hist, queue->hist + HIST_BUCKETS, 0);
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef __FAIR_SCHEDULER_H__
+#define __FAIR_SCHEDULER_H__
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdint.h>
+#include "sqlite_wrapper.h"
+
+/*
+ * FairScheduler: exclusive lock of the connection under LOCK_EXCLUSIVE,
+ * handing it over to the waiting calls in the order of the SchedPolicy
+ *
+ * Reads and writes wait in queues of their own; on unlock the lock goes
+ * straight to the chosen waiter, no other thread can barge in. Waits are
+ * accounted per queue, in a log-linear histogram for the percentiles.
+ */
+class FairScheduler {
+public:
+    FairScheduler(SqliteWrapper::SchedPolicy policy, uint32_t read_burst,
+            uint32_t write_max_wait_ms);
+    void lock(bool read);
+    bool try_lock(void);
+    void unlock(void);
+    void snapshot(SqliteWrapper::SchedStats &stats);
+    void reset(void);
+
+private:
+    struct Waiter {
+        std::condition_variable cv;
+        uint64_t ticket;
+        uint64_t since_ns;
+        bool granted = false;
+    };
+    /* 8 buckets per power of 2 of the wait in ns */
+    static const int HIST_BUCKETS = 64 * 8;
+    struct Queue {
+        std::deque<Waiter *> waiters;
+        uint64_t granted = 0;
+        uint64_t wait_ns = 0;
+        uint64_t max_wait_ns = 0;
+        uint32_t max_queued = 0;
+        uint64_t hist[HIST_BUCKETS] = {};
+    };
+    void account(Queue &queue, uint64_t wait_ns);
+    Waiter *next(uint64_t now_ns);
+    static void fill(const Queue &queue, SqliteWrapper::SchedClassStats &out);
+
+    std::mutex mutex;
+    SqliteWrapper::SchedPolicy policy;
+    uint32_t read_burst;
+    uint64_t write_max_wait_ns;
+    Queue reads;
+    Queue writes;
+    uint64_t next_ticket = 0;
+    uint32_t reads_in_row = 0;  // reads granted while a write was waiting
+    bool held = false;
+};
+
+#endif
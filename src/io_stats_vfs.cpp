@@ -0,0 +1,392 @@
+#include <algorithm>
+#include <chrono>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include "io_stats_vfs.h"
+#include "log.h"
+
+static thread_local IoOpMark io_current = {nullptr, SqliteWrapper::OP_OTHER};
+
+IoOpMark io_op_enter(const IoStatsVfs *owner, int op)
+{
+    IoOpMark prev = io_current;
+
+    io_current.owner = owner;
+    io_current.op = op;
+    return prev;
+}
+
+void io_op_leave(const IoOpMark &prev)
+{
+    io_current = prev;
+}
+
+/*
+ * The shim file is followed in memory by the file of the base VFS
+ */
+struct IoStatsFile {
+    sqlite3_file base;
+    IoStatsVfs *owner;
+    int type;
+    sqlite3_file *real;
+};
+
+static uint64_t now_ns(void)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static inline sqlite3_file *real_of(sqlite3_file *file)
+{
+    return ((IoStatsFile *)file)->real;
+}
+
+static int shim_close(sqlite3_file *file)
+{
+    auto real = real_of(file);
+    return real->pMethods->xClose(real);
+}
+
+static int shim_read(sqlite3_file *file, void *buf, int amt,
+        sqlite3_int64 offset)
+{
+    auto f = (IoStatsFile *)file;
+    uint64_t start = now_ns();
+    int rc = f->real->pMethods->xRead(f->real, buf, amt, offset);
+
+    f->owner->add(f->type, IoStatsVfs::READ_NS, now_ns() - start);
+    f->owner->add(f->type, IoStatsVfs::READS, 1);
+    f->owner->add(f->type, IoStatsVfs::READ_BYTES, amt);
+    return rc;
+}
+
+static int shim_write(sqlite3_file *file, const void *buf, int amt,
+        sqlite3_int64 offset)
+{
+    auto f = (IoStatsFile *)file;
+    uint64_t start = now_ns();
+    int rc = f->real->pMethods->xWrite(f->real, buf, amt, offset);
+
+    f->owner->add(f->type, IoStatsVfs::WRITE_NS, now_ns() - start);
+    f->owner->add(f->type, IoStatsVfs::WRITES, 1);
+    f->owner->add(f->type, IoStatsVfs::WRITE_BYTES, amt);
+    return rc;
+}
+
+static int shim_truncate(sqlite3_file *file, sqlite3_int64 size)
+{
+    auto real = real_of(file);
+    return real->pMethods->xTruncate(real, size);
+}
+
+static int shim_sync(sqlite3_file *file, int flags)
+{
+    auto f = (IoStatsFile *)file;
+    uint64_t start = now_ns();
+    int rc = f->real->pMethods->xSync(f->real, flags);
+
+    f->owner->add(f->type, IoStatsVfs::SYNC_NS, now_ns() - start);
+    f->owner->add(f->type, IoStatsVfs::SYNCS, 1);
+    return rc;
+}
+
+static int shim_file_size(sqlite3_file *file, sqlite3_int64 *size)
+{
+    auto real = real_of(file);
+    return real->pMethods->xFileSize(real, size);
+}
+
+static int shim_lock(sqlite3_file *file, int lock)
+{
+    auto real = real_of(file);
+    return real->pMethods->xLock(real, lock);
+}
+
+static int shim_unlock(sqlite3_file *file, int lock)
+{
+    auto real = real_of(file);
+    return real->pMethods->xUnlock(real, lock);
+}
+
+static int shim_check_reserved_lock(sqlite3_file *file, int *out)
+{
+    auto real = real_of(file);
+    return real->pMethods->xCheckReservedLock(real, out);
+}
+
+static int shim_file_control(sqlite3_file *file, int op, void *arg)
+{
+    auto real = real_of(file);
+    return real->pMethods->xFileControl(real, op, arg);
+}
+
+static int shim_sector_size(sqlite3_file *file)
+{
+    auto real = real_of(file);
+    return real->pMethods->xSectorSize(real);
+}
+
+static int shim_device_characteristics(sqlite3_file *file)
+{
+    auto real = real_of(file);
+    return real->pMethods->xDeviceCharacteristics(real);
+}
+
+static int shim_shm_map(sqlite3_file *file, int page, int page_size,
+        int extend, void volatile **pp)
+{
+    auto real = real_of(file);
+    return real->pMethods->xShmMap(real, page, page_size, extend, pp);
+}
+
+static int shim_shm_lock(sqlite3_file *file, int offset, int n, int flags)
+{
+    auto real = real_of(file);
+    return real->pMethods->xShmLock(real, offset, n, flags);
+}
+
+static void shim_shm_barrier(sqlite3_file *file)
+{
+    auto real = real_of(file);
+    real->pMethods->xShmBarrier(real);
+}
+
+static int shim_shm_unmap(sqlite3_file *file, int delete_flag)
+{
+    auto real = real_of(file);
+    return real->pMethods->xShmUnmap(real, delete_flag);
+}
+
+static int shim_fetch(sqlite3_file *file, sqlite3_int64 offset, int amt,
+        void **pp)
+{
+    auto real = real_of(file);
+    return real->pMethods->xFetch(real, offset, amt, pp);
+}
+
+static int shim_unfetch(sqlite3_file *file, sqlite3_int64 offset, void *p)
+{
+    auto real = real_of(file);
+    return real->pMethods->xUnfetch(real, offset, p);
+}
+
+//one table per io_methods version, matching the version of the base file
+static const sqlite3_io_methods shim_methods[3] = {
+#define SHIM_METHODS(version) { version, shim_close, shim_read, shim_write, \
+    shim_truncate, shim_sync, shim_file_size, shim_lock, shim_unlock, \
+    shim_check_reserved_lock, shim_file_control, shim_sector_size, \
+    shim_device_characteristics, shim_shm_map, shim_shm_lock, \
+    shim_shm_barrier, shim_shm_unmap, shim_fetch, shim_unfetch }
+    SHIM_METHODS(1), SHIM_METHODS(2), SHIM_METHODS(3)
+#undef SHIM_METHODS
+};
+
+static int shim_open(sqlite3_vfs *vfs, const char *name, sqlite3_file *file,
+        int flags, int *out_flags)
+{
+    auto owner = (IoStatsVfs *)vfs->pAppData;
+    auto f = (IoStatsFile *)file;
+    int rc;
+
+    f->owner = owner;
+    f->type = IoStatsVfs::file_type(flags);
+    f->real = (sqlite3_file *)(f + 1);
+    rc = owner->base->xOpen(owner->base, name, f->real, flags, out_flags);
+    if (f->real->pMethods == nullptr) {
+        f->base.pMethods = nullptr;
+        return rc;
+    }
+    int version = f->real->pMethods->iVersion;
+    f->base.pMethods = &shim_methods[std::max(1, std::min(version, 3)) - 1];
+    return rc;
+}
+
+#define BASE(vfs) (((IoStatsVfs *)(vfs)->pAppData)->base)
+
+static int shim_delete(sqlite3_vfs *vfs, const char *name, int sync_dir)
+{
+    return BASE(vfs)->xDelete(BASE(vfs), name, sync_dir);
+}
+
+static int shim_access(sqlite3_vfs *vfs, const char *name, int flags,
+        int *out)
+{
+    return BASE(vfs)->xAccess(BASE(vfs), name, flags, out);
+}
+
+static int shim_full_pathname(sqlite3_vfs *vfs, const char *name, int n,
+        char *out)
+{
+    return BASE(vfs)->xFullPathname(BASE(vfs), name, n, out);
+}
+
+static void *shim_dl_open(sqlite3_vfs *vfs, const char *name)
+{
+    return BASE(vfs)->xDlOpen(BASE(vfs), name);
+}
+
+static void shim_dl_error(sqlite3_vfs *vfs, int n, char *msg)
+{
+    BASE(vfs)->xDlError(BASE(vfs), n, msg);
+}
+
+static void (*shim_dl_sym(sqlite3_vfs *vfs, void *handle,
+            const char *symbol))(void)
+{
+    return BASE(vfs)->xDlSym(BASE(vfs), handle, symbol);
+}
+
+static void shim_dl_close(sqlite3_vfs *vfs, void *handle)
+{
+    BASE(vfs)->xDlClose(BASE(vfs), handle);
+}
+
+static int shim_randomness(sqlite3_vfs *vfs, int n, char *out)
+{
+    return BASE(vfs)->xRandomness(BASE(vfs), n, out);
+}
+
+static int shim_sleep(sqlite3_vfs *vfs, int us)
+{
+    return BASE(vfs)->xSleep(BASE(vfs), us);
+}
+
+static int shim_current_time(sqlite3_vfs *vfs, double *out)
+{
+    return BASE(vfs)->xCurrentTime(BASE(vfs), out);
+}
+
+static int shim_get_last_error(sqlite3_vfs *vfs, int n, char *out)
+{
+    return BASE(vfs)->xGetLastError(BASE(vfs), n, out);
+}
+
+static int shim_current_time_int64(sqlite3_vfs *vfs, sqlite3_int64 *out)
+{
+    return BASE(vfs)->xCurrentTimeInt64(BASE(vfs), out);
+}
+
+static int shim_set_system_call(sqlite3_vfs *vfs, const char *name,
+        sqlite3_syscall_ptr ptr)
+{
+    return BASE(vfs)->xSetSystemCall(BASE(vfs), name, ptr);
+}
+
+static sqlite3_syscall_ptr shim_get_system_call(sqlite3_vfs *vfs,
+        const char *name)
+{
+    return BASE(vfs)->xGetSystemCall(BASE(vfs), name);
+}
+
+static const char *shim_next_system_call(sqlite3_vfs *vfs, const char *name)
+{
+    return BASE(vfs)->xNextSystemCall(BASE(vfs), name);
+}
+
+#undef BASE
+
+IoStatsVfs::IoStatsVfs()
+{
+    char buf[48];
+
+    snprintf(buf, sizeof(buf), "sw_io_stats_%p", (void *)this);
+    vfs_name = buf;
+    memset(&vfs, 0, sizeof(vfs));
+    reset();
+}
+
+IoStatsVfs::~IoStatsVfs()
+{
+    if (registered)
+        sqlite3_vfs_unregister(&vfs);
+}
+
+int IoStatsVfs::install(void)
+{
+    if (registered)
+        return 0;
+    if ((base = sqlite3_vfs_find(nullptr)) == nullptr)
+    {
+        TB_LOG_ERROR("No default VFS to wrap");
+        return -ENOENT;
+    }
+    vfs.iVersion = std::min(base->iVersion, 3);
+    vfs.szOsFile = sizeof(IoStatsFile) + base->szOsFile;
+    vfs.mxPathname = base->mxPathname;
+    vfs.zName = vfs_name.c_str();
+    vfs.pAppData = this;
+    vfs.xOpen = shim_open;
+    vfs.xDelete = shim_delete;
+    vfs.xAccess = shim_access;
+    vfs.xFullPathname = shim_full_pathname;
+    vfs.xDlOpen = base->xDlOpen ? shim_dl_open : nullptr;
+    vfs.xDlError = base->xDlError ? shim_dl_error : nullptr;
+    vfs.xDlSym = base->xDlSym ? shim_dl_sym : nullptr;
+    vfs.xDlClose = base->xDlClose ? shim_dl_close : nullptr;
+    vfs.xRandomness = shim_randomness;
+    vfs.xSleep = shim_sleep;
+    vfs.xCurrentTime = shim_current_time;
+    vfs.xGetLastError = shim_get_last_error;
+    if (vfs.iVersion >= 2)
+        vfs.xCurrentTimeInt64 = shim_current_time_int64;
+    if (vfs.iVersion >= 3) {
+        vfs.xSetSystemCall = shim_set_system_call;
+        vfs.xGetSystemCall = shim_get_system_call;
+        vfs.xNextSystemCall = shim_next_system_call;
+    }
+    if (sqlite3_vfs_register(&vfs, 0) != SQLITE_OK)
+    {
+        TB_LOG_ERROR("Can't register VFS %s", vfs_name.c_str());
+        return -EINVAL;
+    }
+    registered = true;
+    return 0;
+}
+
+int IoStatsVfs::file_type(int open_flags)
+{
+    if (open_flags & SQLITE_OPEN_MAIN_DB)
+        return SqliteWrapper::IO_FILE_DB;
+    if (open_flags & SQLITE_OPEN_WAL)
+        return SqliteWrapper::IO_FILE_WAL;
+    if (open_flags & SQLITE_OPEN_MAIN_JOURNAL)
+        return SqliteWrapper::IO_FILE_JOURNAL;
+    return SqliteWrapper::IO_FILE_OTHER;
+}
+
+void IoStatsVfs::add(int file, int counter, uint64_t value)
+{
+    int op = io_current.owner == this ? io_current.op :
+        SqliteWrapper::OP_OTHER;
+
+    counters[op][file][counter].fetch_add(value, std::memory_order_relaxed);
+}
+
+void IoStatsVfs::snapshot(SqliteWrapper::IoStats &stats)
+{
+    for (int op = 0; op < SqliteWrapper::OP_MAX; op++) {
+        for (int file = 0; file < SqliteWrapper::IO_FILE_MAX; file++) {
+            auto c = counters[op][file];
+            auto &out = stats.counters[op][file];
+
+            out.reads = c[READS].load(std::memory_order_relaxed);
+            out.read_bytes = c[READ_BYTES].load(std::memory_order_relaxed);
+            out.read_ns = c[READ_NS].load(std::memory_order_relaxed);
+            out.writes = c[WRITES].load(std::memory_order_relaxed);
+            out.write_bytes = c[WRITE_BYTES].load(std::memory_order_relaxed);
+            out.write_ns = c[WRITE_NS].load(std::memory_order_relaxed);
+            out.syncs = c[SYNCS].load(std::memory_order_relaxed);
+            out.sync_ns = c[SYNC_NS].load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void IoStatsVfs::reset(void)
+{
+    for (auto &op : counters)
+        for (auto &file : op)
+            for (auto &c : file)
+                c.store(0, std::memory_order_relaxed);
+}
@@ -0,0 +1,58 @@
+#ifndef __IO_STATS_VFS_H__
+#define __IO_STATS_VFS_H__
+
+#include <atomic>
+#include <sqlite3.h>
+#include <string>
+#include "sqlite_wrapper.h"
+
+/*
+ * IoStatsVfs: VFS shim counting the I/O done through the default VFS
+ *
+ * Each wrapper registers its own instance under a unique name and opens its
+ * connection with it, so every file of the connection (database, WAL,
+ * journals) is accounted to that wrapper. Reads, writes and syncs are
+ * counted per file type and per wrapper operation: the operation is the one
+ * the calling thread entered through io_op_enter().
+ */
+class IoStatsVfs {
+public:
+    IoStatsVfs();
+    ~IoStatsVfs();
+    int install(void);
+    const char *name(void) {
+        return vfs_name.c_str();
+    }
+    void snapshot(SqliteWrapper::IoStats &stats);
+    void reset(void);
+
+    enum Counter {
+        READS, READ_BYTES, READ_NS,
+        WRITES, WRITE_BYTES, WRITE_NS,
+        SYNCS, SYNC_NS,
+        COUNTER_MAX
+    };
+    void add(int file, int counter, uint64_t value);
+    static int file_type(int open_flags);
+
+    sqlite3_vfs vfs;
+    sqlite3_vfs *base = nullptr;
+private:
+    std::string vfs_name;
+    bool registered = false;
+    std::atomic<uint64_t> counters[SqliteWrapper::OP_MAX]
+        [SqliteWrapper::IO_FILE_MAX][COUNTER_MAX];
+};
+
+/*
+ * The operation a thread is running on a given wrapper, saved and restored
+ * by nested scopes
+ */
+struct IoOpMark {
+    const IoStatsVfs *owner;
+    int op;
+};
+IoOpMark io_op_enter(const IoStatsVfs *owner, int op);
+void io_op_leave(const IoOpMark &prev);
+
+#endif
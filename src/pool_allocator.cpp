@@ -0,0 +1,320 @@
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include "pool_allocator.h"
+
+/* page cache entries of a 4KB page db are a little more than 4KB */
+static const int class_size[PoolAllocator::NUM_CLASSES] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512,
+    768, 1024, 1536, 2048, 3072, 4096, 4352, 4608, 6144, 8192
+};
+static const int SLAB_BYTES = 64 * 1024;
+static const int SLAB_MIN_BLOCKS = 8;
+static const uint32_t LARGE = PoolAllocator::NUM_CLASSES;
+
+struct BlockHeader {
+    uint32_t cls;
+    uint32_t unused;
+    int64_t size;
+};
+static_assert(sizeof(BlockHeader) == 16, "blocks must stay 16 bytes aligned");
+
+/*
+ * A free block holds the next free block of its list in its header
+ */
+static inline void *&next_of(void *block)
+{
+    return *(void **)block;
+}
+
+struct PoolAllocator::ThreadCache {
+    PoolAllocator *owner;
+    void *head[NUM_CLASSES];
+    uint32_t count[NUM_CLASSES];
+};
+
+static thread_local PoolAllocator::ThreadCache *tls_cache = nullptr;
+static thread_local bool tls_exiting = false;
+
+/*
+ * Gives the blocks cached by an exiting thread back to the shared lists,
+ * the blocks it frees afterwards go there directly
+ */
+struct ThreadCacheGuard {
+    ~ThreadCacheGuard() {
+        tls_exiting = true;
+        if (tls_cache == nullptr)
+            return;
+        tls_cache->owner->release_cache(tls_cache);
+        delete tls_cache;
+        tls_cache = nullptr;
+    }
+};
+static thread_local ThreadCacheGuard tls_guard;
+
+PoolAllocator::PoolAllocator(uint32_t thread_cache_blocks)
+    : thread_cache_blocks(thread_cache_blocks)
+{
+    int cls = 0;
+
+    for (int i = 0; i <= MAX_CLASS_SIZE / 16; ++i) {
+        while (class_size[cls] < i * 16)
+            ++cls;
+        class_lookup[i] = cls;
+    }
+}
+
+int PoolAllocator::class_of(int size)
+{
+    if (size > MAX_CLASS_SIZE)
+        return -1;
+    return class_lookup[(size + 15) / 16];
+}
+
+PoolAllocator::ThreadCache *PoolAllocator::thread_cache(void)
+{
+    if (thread_cache_blocks == 0 || tls_exiting)
+        return nullptr;
+    if (tls_cache == nullptr) {
+        /* touch the guard so that its destructor runs at thread exit */
+        (void)&tls_guard;
+        tls_cache = new ThreadCache();
+        tls_cache->owner = this;
+    }
+    return tls_cache;
+}
+
+void PoolAllocator::release_cache(ThreadCache *tc)
+{
+    for (int cls = 0; cls < NUM_CLASSES; ++cls) {
+        void *last = tc->head[cls];
+
+        if (last == nullptr)
+            continue;
+        while (next_of(last) != nullptr)
+            last = next_of(last);
+        push_shared(cls, tc->head[cls], last);
+        tc->head[cls] = nullptr;
+        tc->count[cls] = 0;
+    }
+}
+
+/*
+ * pop_shared: detach up to max blocks of class cls from its shared list,
+ * carving a new slab if the list is empty
+ *
+ * Return the chain of blocks and its length in count, nullptr if malloc
+ * failed.
+ */
+void *PoolAllocator::pop_shared(int cls, uint32_t max, uint32_t &count)
+{
+    SharedList &list = shared[cls];
+    std::lock_guard<std::mutex> lock(list.lock);
+    void *head, *last;
+
+    if (list.head == nullptr) {
+        int block_size = class_size[cls] + sizeof(BlockHeader);
+        int blocks = std::max(SLAB_BYTES / block_size, SLAB_MIN_BLOCKS);
+        char *slab = (char *)malloc((size_t)blocks * block_size);
+
+        if (slab == nullptr) {
+            count = 0;
+            return nullptr;
+        }
+        slab_bytes.fetch_add((int64_t)blocks * block_size,
+                std::memory_order_relaxed);
+        for (int i = 0; i < blocks - 1; ++i)
+            next_of(slab + (size_t)i * block_size) =
+                slab + (size_t)(i + 1) * block_size;
+        next_of(slab + (size_t)(blocks - 1) * block_size) = nullptr;
+        list.head = slab;
+    }
+    head = last = list.head;
+    count = 1;
+    while (count < max && next_of(last) != nullptr) {
+        last = next_of(last);
+        ++count;
+    }
+    list.head = next_of(last);
+    next_of(last) = nullptr;
+    return head;
+}
+
+void PoolAllocator::push_shared(int cls, void *head, void *tail)
+{
+    std::lock_guard<std::mutex> lock(shared[cls].lock);
+
+    next_of(tail) = shared[cls].head;
+    shared[cls].head = head;
+}
+
+void *PoolAllocator::alloc(int size)
+{
+    uint32_t batch = std::max(thread_cache_blocks / 2, 1u);
+    BlockHeader *hdr;
+    ThreadCache *tc;
+    uint32_t count;
+    int cls;
+
+    if (size < 0)
+        return nullptr;
+    if ((cls = class_of(size)) < 0) {
+        hdr = (BlockHeader *)malloc(sizeof(BlockHeader) + size);
+        if (hdr == nullptr)
+            return nullptr;
+        hdr->cls = LARGE;
+        hdr->size = size;
+        large_bytes.fetch_add(size, std::memory_order_relaxed);
+        return hdr + 1;
+    }
+    if ((tc = thread_cache()) != nullptr) {
+        if (tc->head[cls] == nullptr) {
+            tc->head[cls] = pop_shared(cls, batch, tc->count[cls]);
+            if (tc->head[cls] == nullptr)
+                return nullptr;
+        }
+        hdr = (BlockHeader *)tc->head[cls];
+        tc->head[cls] = next_of(hdr);
+        --tc->count[cls];
+    } else if ((hdr = (BlockHeader *)pop_shared(cls, 1, count)) == nullptr) {
+        return nullptr;
+    }
+    hdr->cls = cls;
+    hdr->size = class_size[cls];
+    return hdr + 1;
+}
+
+void PoolAllocator::free(void *p)
+{
+    BlockHeader *hdr = (BlockHeader *)p - 1;
+    uint32_t batch = std::max(thread_cache_blocks / 2, 1u);
+    ThreadCache *tc;
+    void *head, *last;
+    int cls;
+
+    if (p == nullptr)
+        return;
+    if (hdr->cls == LARGE) {
+        large_bytes.fetch_sub(hdr->size, std::memory_order_relaxed);
+        ::free(hdr);
+        return;
+    }
+    cls = hdr->cls;
+    if ((tc = thread_cache()) == nullptr) {
+        push_shared(cls, hdr, hdr);
+        return;
+    }
+    next_of(hdr) = tc->head[cls];
+    tc->head[cls] = hdr;
+    if (++tc->count[cls] <= thread_cache_blocks)
+        return;
+    /* cache full: give half of it back under a single lock */
+    head = last = tc->head[cls];
+    for (uint32_t i = 1; i < batch; ++i)
+        last = next_of(last);
+    tc->head[cls] = next_of(last);
+    tc->count[cls] -= batch;
+    push_shared(cls, head, last);
+}
+
+void *PoolAllocator::realloc(void *p, int size)
+{
+    BlockHeader *hdr = (BlockHeader *)p - 1;
+    void *q;
+    int cls;
+
+    if (p == nullptr)
+        return alloc(size);
+    if (size < 0)
+        return nullptr;
+    cls = class_of(size);
+    if (hdr->cls == LARGE && cls < 0) {
+        int64_t old_size = hdr->size;
+
+        hdr = (BlockHeader *)::realloc(hdr, sizeof(BlockHeader) + size);
+        if (hdr == nullptr)
+            return nullptr;
+        hdr->size = size;
+        large_bytes.fetch_add(size - old_size, std::memory_order_relaxed);
+        return hdr + 1;
+    }
+    /* shrinking or growing within its class keeps the block */
+    if (hdr->cls != LARGE && (int)hdr->cls == cls)
+        return p;
+    if ((q = alloc(size)) == nullptr)
+        return nullptr;
+    memcpy(q, p, std::min<int64_t>(hdr->size, size));
+    free(p);
+    return q;
+}
+
+int PoolAllocator::size(void *p)
+{
+    if (p == nullptr)
+        return 0;
+    return (int)((BlockHeader *)p - 1)->size;
+}
+
+int PoolAllocator::roundup(int size)
+{
+    int cls = class_of(size);
+
+    if (cls < 0)
+        return (size + 7) & ~7;
+    return class_size[cls];
+}
+
+/*
+ * The methods of sqlite3_mem_methods but xInit and xShutdown take no
+ * context, they all go to the installed allocator
+ */
+static PoolAllocator *installed = nullptr;
+
+static void *pool_malloc(int size)
+{
+    return installed->alloc(size);
+}
+
+static void pool_free(void *p)
+{
+    installed->free(p);
+}
+
+static void *pool_realloc(void *p, int size)
+{
+    return installed->realloc(p, size);
+}
+
+static int pool_size(void *p)
+{
+    return installed->size(p);
+}
+
+static int pool_roundup(int size)
+{
+    return installed->roundup(size);
+}
+
+static int pool_init(void *app)
+{
+    installed = (PoolAllocator *)app;
+    return SQLITE_OK;
+}
+
+static void pool_shutdown(void *app)
+{
+    (void)app;
+}
+
+void PoolAllocator::methods(sqlite3_mem_methods &mem)
+{
+    installed = this;
+    mem.xMalloc = pool_malloc;
+    mem.xFree = pool_free;
+    mem.xRealloc = pool_realloc;
+    mem.xSize = pool_size;
+    mem.xRoundup = pool_roundup;
+    mem.xInit = pool_init;
+    mem.xShutdown = pool_shutdown;
+    mem.pAppData = this;
+}
@@ -0,0 +1,67 @@
+#ifndef __POOL_ALLOCATOR_H__
+#define __POOL_ALLOCATOR_H__
+
+#include <atomic>
+#include <mutex>
+#include <sqlite3.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * PoolAllocator: size class pools for the SQLite allocations
+ *
+ * Requests up to MAX_CLASS_SIZE bytes are served from the free list of the
+ * smallest size class holding them. Each thread keeps up to
+ * thread_cache_blocks free blocks per class, taken from and given back to
+ * the shared free lists in batches, so most calls take no lock at all.
+ * The shared lists are refilled by carving slabs obtained from malloc;
+ * slabs are never given back, the pools keep the peak of each class.
+ * Larger requests go to malloc directly.
+ *
+ * Every block is preceded by a 16 bytes header holding its class, or its
+ * size for the large ones.
+ */
+class PoolAllocator {
+public:
+    PoolAllocator(uint32_t thread_cache_blocks);
+    void *alloc(int size);
+    void free(void *p);
+    void *realloc(void *p, int size);
+    int size(void *p);
+    int roundup(int size);
+    /*
+     * reserved: bytes of the slabs carved by the pools, plus the large
+     * blocks allocated now
+     */
+    int64_t reserved(void) {
+        return slab_bytes.load(std::memory_order_relaxed) +
+            large_bytes.load(std::memory_order_relaxed);
+    }
+    /*
+     * methods: allocator to give to SQLITE_CONFIG_MALLOC
+     */
+    void methods(sqlite3_mem_methods &mem);
+
+    static const int NUM_CLASSES = 20;
+    static const int MAX_CLASS_SIZE = 8192;
+    struct ThreadCache;
+private:
+    int class_of(int size);
+    void *pop_shared(int cls, uint32_t max, uint32_t &count);
+    void push_shared(int cls, void *head, void *tail);
+    ThreadCache *thread_cache(void);
+    void release_cache(ThreadCache *tc);
+    friend struct ThreadCacheGuard;
+
+    struct SharedList {
+        std::mutex lock;
+        void *head = nullptr;
+    };
+    SharedList shared[NUM_CLASSES];
+    uint8_t class_lookup[MAX_CLASS_SIZE / 16 + 1];
+    uint32_t thread_cache_blocks;
+    std::atomic<int64_t> slab_bytes{0};
+    std::atomic<int64_t> large_bytes{0};
+};
+
+#endif
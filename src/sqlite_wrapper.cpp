@@ -1,11 +1,56 @@
 #include <algorithm>
+#include <chrono>
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "fair_scheduler.h"
+#include "hash.h"
+#include "io_stats_vfs.h"
 #include "log.h"
+#include "pool_allocator.h"
 #include "sqlite_wrapper.h"
 
 SqliteWrapper::SqliteWrapper(const std::string &path) {
+    __open(path, Options());
+}
+
+SqliteWrapper::SqliteWrapper(const std::string &path, const Options &options) {
+    __open(path, options);
+}
+
+int SqliteWrapper::__open(const std::string &path, const Options &options)
+{
+    int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+    const char *vfs_name = nullptr;
     int ret = 0;
-    if ((ret = sqlite3_open(path.c_str(), &db)) != SQLITE_OK)
+
+    /*
+     * Unless readers share the connection, every use of it is serialized by
+     * the wrapper (or confined to one thread by the owner): the SQLite
+     * internal mutexes are redundant.
+     */
+    lock_policy = options.lock_policy;
+    plan_warnings = options.plan_warnings;
+    if (lock_policy == LOCK_SHARED)
+        flags |= SQLITE_OPEN_FULLMUTEX;
+    else
+        flags |= SQLITE_OPEN_NOMUTEX;
+    if (lock_policy == LOCK_EXCLUSIVE)
+        scheduler.reset(new FairScheduler(options.sched_policy,
+                    options.read_burst, options.write_max_wait_ms));
+
+    if (options.io_stats) {
+        io_vfs.reset(new IoStatsVfs());
+        if ((ret = io_vfs->install()) != 0)
+            goto end;
+        vfs_name = io_vfs->name();
+    }
+    if ((ret = sqlite3_open_v2(path.c_str(), &db, flags, vfs_name)) !=
+            SQLITE_OK)
     {
         TB_LOG_ERROR("Can't open database: %s", sqlite3_errmsg(db));
         goto end;
@@ -17,22 +62,255 @@ SqliteWrapper::SqliteWrapper(const std::string &path) {
         goto end;
     }
     TB_LOG_DEBUG("DB Opened: %s", path.c_str());
+    default_timeout_ms = options.timeout_ms;
+    sqlite3_progress_handler(db, 1000, deadline_handler, this);
     db_ok = true;
+    //a failed prewarm only leaves the cache cold, the database is usable
+    if (!options.prewarm.empty()) {
+        if (options.prewarm_background)
+            ret = start_prewarm(options.prewarm);
+        else
+            ret = prewarm(options.prewarm);
+        if (ret != 0)
+            TB_LOG_WARNING("Prewarm failed: %d", ret);
+        ret = 0;
+    }
 end:
-    return;
+    return ret;
 }
 
 SqliteWrapper::~SqliteWrapper() {
+    cancel_prewarm();
+    cancel_backup();
+    if (wb_thread.joinable()) {
+        {
+            std::unique_lock<std::mutex> lock(wb_mutex);
+            wb_stop = true;
+        }
+        wb_cv.notify_all();
+        wb_thread.join();
+    }
+    if (flush_write_back() != 0)
+        TB_LOG_ERROR("Buffered updates lost on close");
+    stop_maintenance();
+    stop_reaper();
     if (db != nullptr) {
+        if (change_ring != nullptr) {
+            sqlite3_update_hook(db, nullptr, nullptr);
+            sqlite3_commit_hook(db, nullptr, nullptr);
+            sqlite3_rollback_hook(db, nullptr, nullptr);
+        }
         TB_LOG_DEBUG("DB Closed");
         sqlite3_close(db);
     }
+    //the VFS is unregistered once no connection uses it anymore
+    io_vfs.reset();
+}
+
+static int64_t steady_ms(void)
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+SqliteWrapper::OpScope::OpScope(SqliteWrapper *sw, int op)
+{
+    IoOpMark prev;
+
+    if (sw->io_vfs == nullptr)
+        return;
+    prev = io_op_enter(sw->io_vfs.get(), op);
+    prev_owner = prev.owner;
+    prev_op = prev.op;
+    active = true;
+}
+
+SqliteWrapper::OpScope::~OpScope()
+{
+    if (active)
+        io_op_leave(IoOpMark{prev_owner, prev_op});
+}
+
+/*
+ * With LOCK_SHARED, the read only operations share the connection
+ */
+static bool op_is_read(int op)
+{
+    return op == SqliteWrapper::OP_PEEK_ENTRY ||
+        op == SqliteWrapper::OP_GET_ENTRY || op == SqliteWrapper::OP_CURSOR ||
+        op == SqliteWrapper::OP_COUNT_ENTRIES ||
+        op == SqliteWrapper::OP_EXISTS || op == SqliteWrapper::OP_AGGREGATE ||
+        op == SqliteWrapper::OP_PREWARM;
+}
+
+SqliteWrapper::ConnLock::ConnLock(SqliteWrapper *sw, int op, bool try_only) :
+    sw(sw), read(op_is_read(op)), op_scope(sw, op), background(try_only)
+{
+    switch (sw->lock_policy) {
+        case LOCK_NONE:
+            mode = HELD_NONE;
+            owns = true;
+            return;
+        case LOCK_SHARED:
+            mode = op_is_read(op) ? HELD_SHARED_READ : HELD_SHARED_WRITE;
+            break;
+        default:
+            mode = HELD_MUTEX;
+            break;
+    }
+    if (try_only) {
+        switch (mode) {
+            case HELD_MUTEX:
+                owns = sw->scheduler->try_lock();
+                break;
+            case HELD_SHARED_READ:
+                owns = sw->_shared_mutex.try_lock_shared();
+                break;
+            default:
+                owns = sw->_shared_mutex.try_lock();
+                break;
+        }
+        return;
+    }
+    sw->fg_waiting.fetch_add(1, std::memory_order_relaxed);
+    sw->__preempt_checkpoint();
+    lock();
+    sw->fg_waiting.fetch_sub(1, std::memory_order_relaxed);
+}
+
+SqliteWrapper::ConnLock::~ConnLock()
+{
+    if (owns && mode != HELD_NONE)
+        unlock();
+}
+
+void SqliteWrapper::ConnLock::lock(void)
+{
+    switch (mode) {
+        case HELD_NONE:
+            break;
+        case HELD_MUTEX:
+            sw->scheduler->lock(read);
+            break;
+        case HELD_SHARED_READ:
+            sw->_shared_mutex.lock_shared();
+            break;
+        case HELD_SHARED_WRITE:
+            sw->_shared_mutex.lock();
+            break;
+    }
+    owns = true;
+}
+
+void SqliteWrapper::ConnLock::unlock(void)
+{
+    if (!owns)
+        return;
+    if (!background)
+        sw->last_activity_ms.store(steady_ms(), std::memory_order_relaxed);
+    switch (mode) {
+        case HELD_NONE:
+            break;
+        case HELD_MUTEX:
+            sw->scheduler->unlock();
+            break;
+        case HELD_SHARED_READ:
+            sw->_shared_mutex.unlock_shared();
+            break;
+        case HELD_SHARED_WRITE:
+            sw->_shared_mutex.unlock();
+            break;
+    }
+    owns = false;
+}
+
+/*
+ * Per thread deadline state: the timeout set by a Timeout, and the deadline
+ * of the call the thread runs
+ */
+struct TimeoutMark {
+    const SqliteWrapper *owner;
+    uint32_t timeout_ms;
+};
+struct DeadlineMark {
+    const SqliteWrapper *owner;
+    int64_t deadline_ns;
+    bool expired;
+};
+static thread_local TimeoutMark timeout_current = {nullptr, 0};
+static thread_local DeadlineMark deadline_current = {nullptr, 0, false};
+
+static int64_t steady_ns(void)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+SqliteWrapper::Timeout::Timeout(SqliteWrapper &sw, uint32_t timeout_ms) :
+    prev_owner(timeout_current.owner),
+    prev_timeout_ms(timeout_current.timeout_ms)
+{
+    timeout_current = TimeoutMark{&sw, timeout_ms};
+}
+
+SqliteWrapper::Timeout::~Timeout()
+{
+    timeout_current = TimeoutMark{prev_owner, prev_timeout_ms};
+}
+
+SqliteWrapper::Deadline::Deadline(SqliteWrapper *sw) :
+    sw(sw), prev_owner(deadline_current.owner),
+    prev_deadline_ns(deadline_current.deadline_ns),
+    prev_expired(deadline_current.expired)
+{
+    uint32_t timeout_ms = timeout_current.owner == sw ?
+        timeout_current.timeout_ms :
+        sw->default_timeout_ms.load(std::memory_order_relaxed);
+
+    if (timeout_ms == 0)
+        deadline_current = DeadlineMark{nullptr, 0, false};
+    else
+        deadline_current = DeadlineMark{sw,
+            steady_ns() + (int64_t)timeout_ms * 1000000, false};
+}
+
+SqliteWrapper::Deadline::~Deadline()
+{
+    deadline_current = DeadlineMark{prev_owner, prev_deadline_ns,
+        prev_expired};
+}
+
+int SqliteWrapper::Deadline::result(int ret)
+{
+    if (!deadline_current.expired)
+        return ret;
+    sw->timeouts.fetch_add(1, std::memory_order_relaxed);
+    return -ETIMEDOUT;
+}
+
+/*
+ * Progress handler of the connection, called every 1000 VM instructions by
+ * the thread stepping a statement
+ */
+int SqliteWrapper::deadline_handler(void *arg)
+{
+    auto &mark = deadline_current;
+
+    if (mark.owner != arg || mark.expired ||
+            steady_ns() < mark.deadline_ns)
+        return 0;
+    //interrupt once: the statements rolling the call back must still run
+    TB_LOG_WARNING("Call past its deadline, interrupted");
+    mark.expired = true;
+    return 1;
 }
 
 int SqliteWrapper::create_table(const std::string &table_name,
         const std::string &sql_part)
 {
-    std::unique_lock<std::mutex> lock(_mutex);
+    TraceScope trace(this, TRACE_CREATE_TABLE);
+    Deadline deadline(this);
+    ConnLock lock(this, OP_CREATE_TABLE);
     std::string sql_str = "CREATE TABLE if not exists " + table_name +
         " (" + sql_part + ");";
     char *err_msg = NULL;
@@ -45,22 +323,192 @@ int SqliteWrapper::create_table(const std::string &table_name,
         TB_LOG_ERROR("create table err: %s", err_msg);
         sqlite3_free(err_msg);
     }
+    return trace.done(deadline.result(ret), {&table_name, &sql_part});
+}
+
+static const char *column_type_names[] = {
+    "ANY", "INTEGER", "REAL", "TEXT", "BLOB", "NUMERIC"
+};
+
+static std::string sql_list(const std::vector<std::string> &items)
+{
+    std::string list;
+
+    for (auto const &item : items)
+        list += (list.empty() ? "" : ", ") + item;
+    return list;
+}
+
+int SqliteWrapper::create_table(const TableSchema &schema)
+{
+    ConnLock lock(this, OP_CREATE_TABLE);
+    std::vector<std::pair<std::string, std::string>> indexes;
+    std::string sql_str;
+    int ret = 0;
+
+    if (schema.name.empty() || schema.columns.empty() ||
+            (schema.without_rowid && schema.primary_key.empty()))
+        return -EINVAL;
+    if (schema.strict && sqlite3_libversion_number() < 3037000)
+    {
+        TB_LOG_ERROR("STRICT tables need SQLite 3.37.0 or later");
+        return -ENOTSUP;
+    }
+
+    sql_str = "CREATE TABLE " + schema.name + " (";
+    for (size_t i = 0; i < schema.columns.size(); i++) {
+        auto const &col = schema.columns[i];
+
+        if (col.name.empty() || col.type > COL_NUMERIC ||
+                (schema.strict && col.type == COL_NUMERIC))
+            return -EINVAL;
+        sql_str += (i == 0 ? "" : ", ") + col.name;
+        //without a type the column has no affinity, ANY only exists in STRICT
+        if (col.type != COL_ANY || schema.strict)
+            sql_str += std::string(" ") + column_type_names[col.type];
+        if (col.not_null)
+            sql_str += " NOT NULL";
+        if (!col.default_value.empty())
+            sql_str += " DEFAULT (" + col.default_value + ")";
+    }
+    if (!schema.primary_key.empty())
+        sql_str += ", PRIMARY KEY (" + sql_list(schema.primary_key) + ")";
+    sql_str += ")";
+    if (schema.without_rowid)
+        sql_str += " WITHOUT ROWID";
+    if (schema.strict)
+        sql_str += schema.without_rowid ? ", STRICT" : " STRICT";
+
+    for (auto const &idx : schema.indexes) {
+        std::vector<std::string> columns = idx.columns;
+        std::string name = idx.name;
+
+        if (idx.columns.empty())
+            return -EINVAL;
+        if (name.empty()) {
+            name = schema.name;
+            for (auto const &col : idx.columns)
+                name += "_" + col.substr(0, col.find(' '));
+            name += "_idx";
+        }
+        columns.insert(columns.end(), idx.covering.begin(),
+                idx.covering.end());
+        indexes.emplace_back(name, std::string("CREATE ") +
+                (idx.unique ? "UNIQUE " : "") + "INDEX " + name + " ON " +
+                schema.name + " (" + sql_list(columns) + ")" +
+                (idx.where.empty() ? "" : " WHERE " + idx.where));
+    }
+
+    if ((ret = __savepoint("__sw_schema")) != 0)
+        return ret;
+    if ((ret = __apply_schema_sql("table", schema.name, sql_str)) != 0)
+        goto FAILED;
+    for (auto const &idx : indexes) {
+        if ((ret = __apply_schema_sql("index", idx.first, idx.second)) != 0)
+            goto FAILED;
+    }
+    return __release("__sw_schema");
+FAILED:
+    __rollback_to("__sw_schema");
     return ret;
 }
 
+/*
+ * Run the CREATE statement sql_str unless the object exists. SQLite keeps
+ * the statement text, an existing object created from another text has
+ * another definition.
+ */
+int SqliteWrapper::__apply_schema_sql(const std::string &type,
+        const std::string &name, const std::string &sql_str)
+{
+    sqlite3_stmt *stmt;
+    int ret = 0;
+
+    if (sqlite3_prepare_v2(db, "SELECT sql FROM sqlite_master WHERE "
+                "type = ? AND name = ? COLLATE NOCASE;", -1, &stmt, NULL) !=
+            SQLITE_OK)
+    {
+        TB_LOG_ERROR("sqlite3 prepare failed");
+        return -EINVAL;
+    }
+    sqlite3_bind_text(stmt, 1, type.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, name.c_str(), -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        auto existing = (const char *)sqlite3_column_text(stmt, 0);
+
+        if (existing == nullptr || sql_str != existing) {
+            TB_LOG_ERROR("%s %s exists with another definition: %s",
+                    type.c_str(), name.c_str(),
+                    existing == nullptr ? "" : existing);
+            ret = -EEXIST;
+        }
+        sqlite3_finalize(stmt);
+        return ret;
+    }
+    sqlite3_finalize(stmt);
+    TB_LOG_DEBUG("sql: %s", sql_str.c_str());
+    return __exec(sql_str + ";");
+}
+
+/*
+ * Warn once per distinct statement when its plan scans a whole table or
+ * index
+ */
+void SqliteWrapper::__check_plan(const std::string &sql_str)
+{
+    sqlite3_stmt *stmt;
+
+    if (!plan_warnings)
+        return;
+    {
+        std::unique_lock<std::mutex> lock(plan_mutex);
+
+        if (plan_checked.count(sql_str) != 0)
+            return;
+        //statements with inlined values are all distinct, bound the memory
+        if (plan_checked.size() >= 4096)
+            plan_checked.clear();
+        plan_checked.insert(sql_str);
+    }
+    if (sqlite3_prepare_v2(db, ("EXPLAIN QUERY PLAN " + sql_str).c_str(), -1,
+                &stmt, NULL) != SQLITE_OK)
+        return;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        auto detail = (const char *)sqlite3_column_text(stmt, 3);
+
+        if (detail == nullptr || strncmp(detail, "SCAN ", 5) != 0 ||
+                strstr(detail, "CONSTANT ROW") != nullptr)
+            continue;
+        full_scans.fetch_add(1, std::memory_order_relaxed);
+        TB_LOG_WARNING("Full scan (%s): %s", detail, sql_str.c_str());
+    }
+    sqlite3_finalize(stmt);
+}
+
 bool SqliteWrapper::peek_entry(const std::string &table_name,
             const std::string &sql_part)
 {
-    std::unique_lock<std::mutex> lock(_mutex);
-    return __peek_entry(table_name, sql_part);
+    TraceScope trace(this, TRACE_PEEK_ENTRY);
+    __wb_flush(table_name);
+    Deadline deadline(this);
+    ConnLock lock(this, OP_PEEK_ENTRY);
+    bool found = __peek_entry(table_name, sql_part);
+
+    //a timed out lookup is reported as not found
+    return trace.done(deadline.result(found) == 1, {&table_name, &sql_part});
 }
 
 int SqliteWrapper::insert_entry(const std::string &table_name,
         const std::string &sql_part,
         std::map<const std::string, std::vector<uint8_t>*> *blobs)
 {
-    std::unique_lock<std::mutex> lock(_mutex);
-    return __insert_entry(table_name, sql_part, blobs);
+    TraceScope trace(this, TRACE_INSERT_ENTRY);
+    __wb_flush(table_name);
+    Deadline deadline(this);
+    ConnLock lock(this, OP_INSERT_ENTRY);
+    return trace.done(deadline.result(__insert_entry(table_name, sql_part,
+                    blobs)),
+            {&table_name, &sql_part}, blobs);
 }
 
 int SqliteWrapper::update_entry(const std::string &table_name,
@@ -68,9 +516,13 @@ int SqliteWrapper::update_entry(const std::string &table_name,
             const std::string &sql_part_filter,
             std::map<const std::string, std::vector<uint8_t>*> *blobs)
 {
-    std::unique_lock<std::mutex> lock(_mutex);
-    return __update_entry(table_name, sql_part_update,
-            sql_part_filter, blobs);
+    TraceScope trace(this, TRACE_UPDATE_ENTRY);
+    __wb_flush(table_name);
+    Deadline deadline(this);
+    ConnLock lock(this, OP_UPDATE_ENTRY);
+    return trace.done(deadline.result(__update_entry(table_name,
+                    sql_part_update, sql_part_filter, blobs)),
+            {&table_name, &sql_part_update, &sql_part_filter}, blobs);
 }
 
 int SqliteWrapper::insert_update_entry(const std::string &table_name,
@@ -79,25 +531,36 @@ int SqliteWrapper::insert_update_entry(const std::string &table_name,
             const std::string &sql_part_filter,
             std::map<const std::string, std::vector<uint8_t>*> *blobs)
 {
-    std::unique_lock<std::mutex> lock(_mutex);
-    if (__peek_entry(table_name, sql_part_filter))
-        return __update_entry(table_name, sql_part_update,
-                sql_part_filter, blobs);
-    else
-        return __insert_entry(table_name, sql_part_insert, blobs);
+    TraceScope trace(this, TRACE_INSERT_UPDATE_ENTRY);
+    __wb_flush(table_name);
+    Deadline deadline(this);
+    ConnLock lock(this, OP_INSERT_UPDATE_ENTRY);
+    return trace.done(deadline.result(__insert_update_entry(table_name,
+                    sql_part_insert, sql_part_update, sql_part_filter,
+                    blobs)),
+            {&table_name, &sql_part_insert, &sql_part_update,
+            &sql_part_filter}, blobs);
 }
 
 int SqliteWrapper::delete_entry(const std::string &table_name,
             const std::string &sql_part)
 {
-    std::unique_lock<std::mutex> lock(_mutex);
-    return __delete_entry(table_name, sql_part);
+    TraceScope trace(this, TRACE_DELETE_ENTRY);
+    __wb_flush(table_name);
+    Deadline deadline(this);
+    ConnLock lock(this, OP_DELETE_ENTRY);
+    return trace.done(deadline.result(__delete_entry(table_name, sql_part)),
+            {&table_name, &sql_part});
 }
 
 int SqliteWrapper::delete_all_entry(const std::string &table_name)
 {
-    std::unique_lock<std::mutex> lock(_mutex);
-    return __delete_all_entry(table_name);
+    TraceScope trace(this, TRACE_DELETE_ALL_ENTRY);
+    __wb_flush(table_name);
+    Deadline deadline(this);
+    ConnLock lock(this, OP_DELETE_ALL_ENTRY);
+    return trace.done(deadline.result(__delete_all_entry(table_name)),
+            {&table_name});
 }
 
 int SqliteWrapper::get_entry(std::vector<GetItem> &out,
@@ -105,17 +568,59 @@ int SqliteWrapper::get_entry(std::vector<GetItem> &out,
             const std::string &sql_values,
             const std::string &sql_filter)
 {
-    std::unique_lock<std::mutex> lock(_mutex);
-    return __get_entry(out, table_name, sql_values, sql_filter);
+    TraceScope trace(this, TRACE_GET_ENTRY);
+    __wb_flush(table_name);
+    Deadline deadline(this);
+    ConnLock lock(this, OP_GET_ENTRY);
+    return trace.done(deadline.result(__get_entry(out, table_name,
+                    sql_values, sql_filter)),
+            {&table_name, &sql_values, &sql_filter}, nullptr, out.size());
+}
+
+int SqliteWrapper::count_entries(int64_t &count,
+        const std::string &table_name, const std::string &sql_filter)
+{
+    TraceScope trace(this, TRACE_COUNT_ENTRIES);
+    __wb_flush(table_name);
+    Deadline deadline(this);
+    ConnLock lock(this, OP_COUNT_ENTRIES);
+    return trace.done(deadline.result(__count_entries(count, table_name,
+                    sql_filter)), {&table_name, &sql_filter});
+}
+
+int SqliteWrapper::exists(const std::string &table_name,
+        const std::string &sql_filter)
+{
+    TraceScope trace(this, TRACE_EXISTS);
+    __wb_flush(table_name);
+    Deadline deadline(this);
+    ConnLock lock(this, OP_EXISTS);
+    return trace.done(deadline.result(__exists(table_name, sql_filter)),
+            {&table_name, &sql_filter});
+}
+
+int SqliteWrapper::aggregate(Value &result, const std::string &table_name,
+        AggregateFn fn, const std::string &column,
+        const std::string &sql_filter)
+{
+    TraceScope trace(this, TRACE_AGGREGATE);
+    __wb_flush(table_name);
+    Deadline deadline(this);
+    ConnLock lock(this, OP_AGGREGATE);
+    return trace.done(deadline.result(__aggregate(result, table_name, fn,
+                    column, sql_filter)),
+            {&table_name, &column, &sql_filter}, nullptr, fn);
 }
 
 bool SqliteWrapper::__peek_entry(const std::string &table_name,
             const std::string &sql_part)
 {
-    std::string sql_str = "SELECT * FROM " + table_name + " " +
+    //no column is read, an index on the filter columns is enough
+    std::string sql_str = "SELECT 1 FROM " + table_name + " " +
         sql_part + ";";
     sqlite3_stmt *stmt;
 
+    __check_plan(sql_str);
     TB_LOG_DEBUG("sqlite3 prepare: %s", sql_str.c_str());
     if (sqlite3_prepare_v2(db, sql_str.c_str(), -1, &stmt,
                 NULL) !=
@@ -141,9 +646,35 @@ int SqliteWrapper::__insert_entry(const std::string &table_name,
             const std::string &sql_part,
             std::map<const std::string, std::vector<uint8_t>*> *blobs)
 {
-    std::string sql_str = "INSERT INTO " + table_name + " " + sql_part + ";";
+    std::string sql_str = "INSERT INTO " + table_name + " " + sql_part;
+    std::map<const std::string, std::vector<uint8_t>*> refs;
+    std::vector<std::vector<uint8_t>> ref_bufs;
+    std::vector<int64_t> ids;
+    int ret = 0;
 
-    return __exec_sql_1(sql_str, blobs);
+    if (!blob_dedup)
+        return __exec_sql_1(sql_str + ";", blobs);
+    if ((ret = __dedup_check_write(table_name, sql_part)) != 0)
+        return ret;
+    if (blobs == nullptr || blobs->empty())
+        return __exec_sql_1(sql_str + ";", blobs);
+
+    if ((ret = __savepoint("__sw_dedup")) != 0)
+        return ret;
+    if ((ret = __dedup_store_blobs(*blobs, refs, ref_bufs, ids)) != 0)
+        goto FAILED;
+    //count the references the inserted rows actually hold
+    if ((ret = __exec_sql_1(sql_str + " RETURNING *;", &refs,
+                    [this, &ids](sqlite3_stmt *stmt) {
+                        return __dedup_adjust_row(stmt, 0, 1, ids);
+                    })) != 0)
+        goto FAILED;
+    if ((ret = __dedup_gc(ids)) != 0)
+        goto FAILED;
+    return __release("__sw_dedup");
+FAILED:
+    __rollback_to("__sw_dedup");
+    return ret;
 }
 
 int SqliteWrapper::__update_entry(const std::string &table_name,
@@ -152,9 +683,55 @@ int SqliteWrapper::__update_entry(const std::string &table_name,
             std::map<const std::string, std::vector<uint8_t>*> *blobs)
 {
     std::string sql_str = "UPDATE " + table_name + " SET " + sql_update + " " +
-        sql_filter + ";";
+        sql_filter;
+    std::map<const std::string, std::vector<uint8_t>*> refs;
+    std::vector<std::vector<uint8_t>> ref_bufs;
+    std::vector<int64_t> ids;
+    int ret = 0;
+
+    __check_plan(sql_str + ";");
+    if (!blob_dedup)
+        return __exec_sql_1(sql_str + ";", blobs);
+    if ((ret = __dedup_check_write(table_name, "")) != 0)
+        return ret;
+    if (blobs == nullptr || blobs->empty())
+        return __exec_sql_1(sql_str + ";", blobs);
+
+    /*
+     * The SET part may replace or keep any reference held by the matched
+     * rows, so release all of them before the update and take them again
+     * from the rows the update returns, whatever their new rowid.
+     */
+    if ((ret = __savepoint("__sw_dedup")) != 0)
+        return ret;
+    if ((ret = __dedup_release_rows(table_name, sql_filter, ids)) != 0)
+        goto FAILED;
+    if ((ret = __dedup_store_blobs(*blobs, refs, ref_bufs, ids)) != 0)
+        goto FAILED;
+    if ((ret = __exec_sql_1(sql_str + " RETURNING *;", &refs,
+                    [this, &ids](sqlite3_stmt *stmt) {
+                        return __dedup_adjust_row(stmt, 0, 1, ids);
+                    })) != 0)
+        goto FAILED;
+    if ((ret = __dedup_gc(ids)) != 0)
+        goto FAILED;
+    return __release("__sw_dedup");
+FAILED:
+    __rollback_to("__sw_dedup");
+    return ret;
+}
 
-    return __exec_sql_1(sql_str, blobs);
+int SqliteWrapper::__insert_update_entry(const std::string &table_name,
+            const std::string &sql_part_insert,
+            const std::string &sql_part_update,
+            const std::string &sql_part_filter,
+            std::map<const std::string, std::vector<uint8_t>*> *blobs)
+{
+    if (__peek_entry(table_name, sql_part_filter))
+        return __update_entry(table_name, sql_part_update,
+                sql_part_filter, blobs);
+    else
+        return __insert_entry(table_name, sql_part_insert, blobs);
 }
 
 int SqliteWrapper::__delete_entry(const std::string &table_name,
@@ -162,21 +739,54 @@ int SqliteWrapper::__delete_entry(const std::string &table_name,
 {
     std::string sql_str = "DELETE from " + table_name + " " +
         sql_part;
-    return __exec_sql_1(sql_str);
+    std::vector<int64_t> ids;
+    int ret = 0;
+
+    __check_plan(sql_str);
+    if (!blob_dedup)
+        return __exec_sql_1(sql_str);
+
+    if ((ret = __savepoint("__sw_dedup")) != 0)
+        return ret;
+    if ((ret = __dedup_release_rows(table_name, sql_part, ids)) != 0)
+        goto FAILED;
+    if ((ret = __exec_sql_1(sql_str)) != 0)
+        goto FAILED;
+    if ((ret = __dedup_gc(ids)) != 0)
+        goto FAILED;
+    return __release("__sw_dedup");
+FAILED:
+    __rollback_to("__sw_dedup");
+    return ret;
 }
 
 int SqliteWrapper::__delete_all_entry(const std::string &table_name)
 {
-    std::string sql_str = "DELETE from " + table_name + ";";
+    if (blob_dedup)
+        return __delete_entry(table_name, "");
+
+    /*
+     * An unfiltered DELETE takes the truncate optimization, which skips the
+     * update hook: the rows must go one by one while changes are captured.
+     */
+    std::string sql_str = "DELETE from " + table_name +
+        (change_ring != nullptr ? " WHERE 1;" : ";");
     return __exec_sql_1(sql_str);
 }
 
+/*
+ * Run a single statement. The rows it returns, if any, go to on_row: a
+ * failure of on_row fails the statement.
+ */
 int SqliteWrapper::__exec_sql_1(const std::string &sql_str,
-            std::map<const std::string, std::vector<uint8_t>*> *blobs)
+            std::map<const std::string, std::vector<uint8_t>*> *blobs,
+            const std::function<int(sqlite3_stmt *)> &on_row)
 {
     sqlite3_stmt *stmt;
+    size_t change_mark = change_pending.size();
     TB_LOG_DEBUG("sqlite3 prepare: %s", sql_str.c_str());
     int ret;
+    int rc;
     if (sqlite3_prepare_v2(db, sql_str.c_str(), -1, &stmt,
                 NULL) !=
             SQLITE_OK)
@@ -203,9 +813,17 @@ int SqliteWrapper::__exec_sql_1(const std::string &sql_str,
         }
     }
 DONE_BLOBS:
-    if (sqlite3_step(stmt) != SQLITE_DONE)
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW && on_row != nullptr) {
+        if ((ret = on_row(stmt)) != 0) {
+            __drop_changes(change_mark);
+            sqlite3_finalize(stmt);
+            return ret;
+        }
+    }
+    if (rc != SQLITE_DONE)
     {
         TB_LOG_ERROR("sqlite3 step failed");
+        __drop_changes(change_mark);
         goto SQILTE3_STEP_FAILED;
     }
     sqlite3_finalize(stmt);
@@ -223,11 +841,15 @@ int SqliteWrapper::__get_entry(std::vector<GetItem> &out,
         const std::string &sql_filter)
 {
     sqlite3_stmt *stmt;
+    sqlite3_stmt *res_stmt = nullptr;
     std::string sql_str = "SELECT " + sql_values + " FROM " + table_name +
         " " + sql_filter + ";";
+    const void *data = nullptr;
+    uint32_t len = 0;
     int idx = 0;
     int ret = 0;
 
+    __check_plan(sql_str);
     TB_LOG_DEBUG("sqlite3 get: %s", sql_str.c_str());
     if (sqlite3_prepare_v2(db, sql_str.c_str(), -1, &stmt,
                 NULL) !=
@@ -246,51 +868,32 @@ int SqliteWrapper::__get_entry(std::vector<GetItem> &out,
 
     for(auto const &itr : out) {
         auto type = sqlite3_column_type(stmt, idx);
-        auto buf = itr.buf;
-        auto copy = itr.ext_copy;
-
-        switch(type) {
-            case SQLITE_INTEGER:
-                if (itr.len < 8)
-                    *(int *)buf = sqlite3_column_int(stmt, idx);
-                else
-                    *(int64_t *)buf = sqlite3_column_int64(stmt, idx);
-                break;
-            case SQLITE_FLOAT:
-                *(double *)buf = sqlite3_column_double(stmt, idx);
-                break;
-            case SQLITE_TEXT:
-                if (copy != nullptr) {
-                    if (copy(sqlite3_column_text(stmt, idx),
-                                (uint32_t)sqlite3_column_bytes(stmt, idx)) != 0) {
-                        ret = -ENOMEM;
-                        goto END;
-                    }
-                } else {
-                    memcpy(buf, sqlite3_column_text(stmt, idx),
-                        std::min(itr.len, (uint32_t)sqlite3_column_bytes(stmt, idx)));
-                }
-                break;
-            case SQLITE_BLOB:
-                if (copy != nullptr) {
-                    if (copy(sqlite3_column_blob(stmt, idx),
-                                (uint32_t)sqlite3_column_bytes(stmt, idx)) != 0) {
-                        ret = -ENOMEM;
-                        goto END;
-                    }
-                } else {
-                    memcpy(buf, sqlite3_column_blob(stmt, idx),
-                        std::min(itr.len, (uint32_t)sqlite3_column_bytes(stmt, idx)));
-                }
-                break;
-            default:
-                TB_LOG_ERROR("Unexpected SQL NULL type in col: %d", idx);
-                ret = -EINVAL;
+
+        data = nullptr;
+        len = 0;
+        if (type == SQLITE_TEXT) {
+            data = sqlite3_column_text(stmt, idx);
+            len = (uint32_t)sqlite3_column_bytes(stmt, idx);
+        } else if (type == SQLITE_BLOB) {
+            data = sqlite3_column_blob(stmt, idx);
+            len = (uint32_t)sqlite3_column_bytes(stmt, idx);
+            if (blob_dedup &&
+                    (ret = __dedup_resolve(db, data, len, res_stmt)) != 0)
                 goto END;
         }
+        ret = __copy_column(itr, type, sqlite3_column_int64(stmt, idx),
+                sqlite3_column_double(stmt, idx), data, len);
+        sqlite3_finalize(res_stmt);
+        res_stmt = nullptr;
+        if (ret != 0) {
+            if (ret == -EINVAL)
+                TB_LOG_ERROR("Unexpected SQL NULL type in col: %d", idx);
+            goto END;
+        }
         idx++;
     }
 END:
+    sqlite3_finalize(res_stmt);
     sqlite3_finalize(stmt);
     return ret;
 
@@ -299,6 +902,2444 @@ SQILTE3_STEP_FAILED:
 SQILTE3_PREPARE_FAILED:
     return ret;
 }
+
+int SqliteWrapper::__count_entries(int64_t &count,
+        const std::string &table_name, const std::string &sql_filter)
+{
+    Value value;
+    int ret;
+
+    if ((ret = __scalar("SELECT count(*) FROM " + table_name + " " +
+                    sql_filter + ";", value)) != 0)
+        return ret;
+    count = value.i;
+    return 0;
+}
+
+int SqliteWrapper::__exists(const std::string &table_name,
+        const std::string &sql_filter)
+{
+    Value value;
+    int ret;
+
+    ret = __scalar("SELECT 1 FROM " + table_name + " " + sql_filter + ";",
+            value);
+    if (ret == -ENOENT)
+        return 0;
+    return ret == 0 ? 1 : ret;
+}
+
+static const char *aggregate_names[SqliteWrapper::AGG_MAX_FN] = {
+    "count", "min", "max", "sum"
+};
+
+int SqliteWrapper::__aggregate(Value &result, const std::string &table_name,
+        AggregateFn fn, const std::string &column,
+        const std::string &sql_filter)
+{
+    if (fn < AGG_COUNT || fn >= AGG_MAX_FN || column.empty())
+        return -EINVAL;
+    result = Value();
+    return __scalar(std::string("SELECT ") + aggregate_names[fn] + "(" +
+            column + ") FROM " + table_name + " " + sql_filter + ";", result);
+}
+
+/*
+ * Run a query and load the first column of its first row, -ENOENT if it
+ * returns no row
+ */
+int SqliteWrapper::__scalar(const std::string &sql_str, Value &result)
+{
+    sqlite3_stmt *stmt;
+    int ret = 0;
+    int rc;
+
+    __check_plan(sql_str);
+    TB_LOG_DEBUG("sqlite3 prepare: %s", sql_str.c_str());
+    if (sqlite3_prepare_v2(db, sql_str.c_str(), -1, &stmt, NULL) !=
+            SQLITE_OK)
+    {
+        TB_LOG_ERROR("sqlite3 prepare failed: %s", sqlite3_errmsg(db));
+        return -EINVAL;
+    }
+    if ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        ret = __load_column(stmt, 0, result);
+    } else if (rc == SQLITE_DONE) {
+        ret = -ENOENT;
+    } else {
+        TB_LOG_ERROR("sqlite3 step failed: %s", sqlite3_errmsg(db));
+        ret = -EAGAIN;
+    }
+    sqlite3_finalize(stmt);
+    return ret;
+}
+
+/*
+ * Copy one column value to the output item, following the GetItem rules
+ */
+int SqliteWrapper::__copy_column(const GetItem &item, int type, int64_t i,
+        double d, const void *data, uint32_t len)
+{
+    switch(type) {
+        case SQLITE_INTEGER:
+            if (item.len < 8)
+                *(int *)item.buf = (int)i;
+            else
+                *(int64_t *)item.buf = i;
+            break;
+        case SQLITE_FLOAT:
+            *(double *)item.buf = d;
+            break;
+        case SQLITE_TEXT:
+        case SQLITE_BLOB:
+            if (item.ext_copy != nullptr) {
+                if (item.ext_copy(data, len) != 0)
+                    return -ENOMEM;
+            } else {
+                memcpy(item.buf, data, std::min(item.len, len));
+            }
+            break;
+        default:
+            return -EINVAL;
+    }
+    return 0;
+}
+
+/*
+ * Load one column of the current row of stmt, resolving blob references
+ */
+int SqliteWrapper::__load_column(sqlite3_stmt *stmt, int idx, Value &value)
+{
+    sqlite3_stmt *res_stmt = nullptr;
+    const void *data;
+    uint32_t len;
+    int ret = 0;
+
+    value.type = sqlite3_column_type(stmt, idx);
+    switch (value.type) {
+        case SQLITE_INTEGER:
+            value.i = sqlite3_column_int64(stmt, idx);
+            break;
+        case SQLITE_FLOAT:
+            value.d = sqlite3_column_double(stmt, idx);
+            break;
+        case SQLITE_TEXT:
+        case SQLITE_BLOB:
+            if (value.type == SQLITE_TEXT)
+                data = sqlite3_column_text(stmt, idx);
+            else
+                data = sqlite3_column_blob(stmt, idx);
+            len = (uint32_t)sqlite3_column_bytes(stmt, idx);
+            if (value.type == SQLITE_BLOB && blob_dedup &&
+                    (ret = __dedup_resolve(sqlite3_db_handle(stmt), data, len,
+                        res_stmt)) != 0)
+                break;
+            value.bytes.assign((const uint8_t *)data,
+                    (const uint8_t *)data + len);
+            break;
+        default:
+            break;
+    }
+    sqlite3_finalize(res_stmt);
+    return ret;
+}
+
+void SqliteWrapper::__bind_value(sqlite3_stmt *stmt, int idx,
+        const Value &value)
+{
+    switch (value.type) {
+        case SQLITE_INTEGER:
+            sqlite3_bind_int64(stmt, idx, value.i);
+            break;
+        case SQLITE_FLOAT:
+            sqlite3_bind_double(stmt, idx, value.d);
+            break;
+        case SQLITE_TEXT:
+            sqlite3_bind_text(stmt, idx, (const char *)value.bytes.data(),
+                    value.bytes.size(), SQLITE_TRANSIENT);
+            break;
+        case SQLITE_BLOB:
+            sqlite3_bind_blob(stmt, idx, value.bytes.data(),
+                    value.bytes.size(), SQLITE_TRANSIENT);
+            break;
+        default:
+            sqlite3_bind_null(stmt, idx);
+            break;
+    }
+}
+
+SqliteWrapper::Cursor::Cursor(SqliteWrapper &sw, const std::string &table_name,
+        const std::string &sql_values,
+        const std::string &sql_filter,
+        const std::string &key_column,
+        uint32_t page_size) :
+    sw(sw), table_name(table_name), page_size(page_size == 0 ? 1 : page_size)
+{
+    std::string select = "SELECT " + key_column + ", " + sql_values +
+        " FROM " + table_name + " WHERE ";
+    std::string filter = sql_filter.empty() ? "" : "(" + sql_filter + ") AND ";
+    std::string order = " ORDER BY " + key_column + " LIMIT ?;";
+
+    sql_first = select + (sql_filter.empty() ? "1" : "(" + sql_filter + ")") +
+        order;
+    sql_next = select + filter + key_column + " > ?" + order;
+}
+
+int SqliteWrapper::Cursor::next(std::vector<GetItem> &out)
+{
+    int ret = 0;
+    size_t idx = 1;
+
+    if (pos == rows.size()) {
+        if (eof)
+            return -ENOENT;
+        if ((ret = fetch_page()) != 0)
+            return ret;
+        if (rows.empty())
+            return -ENOENT;
+    }
+
+    auto const &row = rows[pos++];
+    for (auto const &itr : out) {
+        if (idx >= row.size())
+            return -EINVAL;
+        auto const &value = row[idx++];
+        if ((ret = __copy_column(itr, value.type, value.i, value.d,
+                        value.bytes.data(), value.bytes.size())) != 0)
+            return ret;
+    }
+    return 0;
+}
+
+/*
+ * Fetch the page following the last key seen. Only this function touches
+ * the connection, under the wrapper lock; the previous page is dropped so
+ * memory stays bounded by page_size.
+ */
+int SqliteWrapper::Cursor::fetch_page(void)
+{
+    sw.__wb_flush(table_name);
+    Deadline deadline(&sw);
+    ConnLock lock(&sw, OP_CURSOR);
+    sqlite3_stmt *stmt;
+    bool first = !started;
+    int ret = 0;
+    int rc;
+
+    rows.clear();
+    pos = 0;
+
+    TB_LOG_DEBUG("sqlite3 page: %s", first ? sql_first.c_str() :
+            sql_next.c_str());
+    if (sqlite3_prepare_v2(sw.db, first ? sql_first.c_str() : sql_next.c_str(),
+                -1, &stmt, NULL) != SQLITE_OK)
+    {
+        TB_LOG_ERROR("sqlite3 prepare failed");
+        return -EINVAL;
+    }
+    if (!first)
+        __bind_value(stmt, 1, last_key);
+    sqlite3_bind_int64(stmt, first ? 1 : 2, page_size);
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        int cols = sqlite3_column_count(stmt);
+
+        rows.emplace_back(cols);
+        for (int i = 0; i < cols; i++) {
+            if ((ret = sw.__load_column(stmt, i, rows.back()[i])) != 0)
+                goto END;
+        }
+    }
+    if (rc != SQLITE_DONE)
+    {
+        TB_LOG_ERROR("sqlite3 step failed");
+        ret = -EAGAIN;
+        goto END;
+    }
+    if (rows.size() < page_size)
+        eof = true;
+    if (!rows.empty()) {
+        last_key = rows.back()[0];
+        started = true;
+    }
+END:
+    sqlite3_finalize(stmt);
+    ret = deadline.result(ret);
+    if (ret != 0)
+        rows.clear();
+    return ret;
+}
+
+SqliteWrapper::Transaction::Transaction(SqliteWrapper &sw) : sw(sw)
+{
+    TraceScope trace(&sw, TRACE_TX_BEGIN);
+
+    //buffered updates are older than the transaction, they must not be
+    //rolled back with it
+    sw.flush_write_back();
+    lock.reset(new ConnLock(&sw, OP_TRANSACTION));
+    active = (sw.__exec("BEGIN IMMEDIATE;") == 0);
+    trace.done(active ? 0 : -EAGAIN, {});
+}
+
+SqliteWrapper::Transaction::Transaction(Transaction &parent) :
+    sw(parent.sw), parent(&parent)
+{
+    TraceScope trace(&sw, TRACE_TX_BEGIN);
+
+    //one nested Transaction at a time, its savepoint is named by depth
+    if (!parent.is_ok() || parent.children > 0)
+        return;
+    depth = parent.depth + 1;
+    savepoint = "__sw_tx_" + std::to_string(depth);
+    active = (sw.__savepoint(savepoint) == 0);
+    if (active)
+        parent.children++;
+    trace.done(active ? 0 : -EAGAIN, {}, nullptr, depth);
+}
+
+SqliteWrapper::Transaction::~Transaction()
+{
+    if (active)
+        end(false);
+}
+
+int SqliteWrapper::Transaction::commit(void)
+{
+    return end(true);
+}
+
+int SqliteWrapper::Transaction::rollback(void)
+{
+    return end(false);
+}
+
+/*
+ * dead: SQLite rolled back the whole transaction under this Transaction
+ */
+bool SqliteWrapper::Transaction::dead(void)
+{
+    Transaction *root = this;
+
+    while (root->parent != nullptr)
+        root = root->parent;
+    return root->rolled_back;
+}
+
+/*
+ * settle: result of a call; if it failed and left no transaction open,
+ * SQLite rolled it back (e.g. an interrupted write), every Transaction of
+ * the chain is dead
+ */
+int SqliteWrapper::Transaction::settle(int ret)
+{
+    Transaction *root = this;
+
+    if (ret >= 0 || !sqlite3_get_autocommit(sw.db))
+        return ret;
+    while (root->parent != nullptr)
+        root = root->parent;
+    if (!root->rolled_back)
+        TB_LOG_WARNING("Transaction rolled back by SQLite after error %d",
+                ret);
+    root->rolled_back = true;
+    return ret;
+}
+
+int SqliteWrapper::Transaction::end(bool do_commit)
+{
+    TraceScope trace(&sw, do_commit ? TRACE_TX_COMMIT : TRACE_TX_ROLLBACK);
+    int ret = 0;
+
+    if (!active)
+        return -EINVAL;
+    if (children > 0) {
+        TB_LOG_ERROR("Transaction ended before its nested ones");
+        return -EBUSY;
+    }
+    if (dead()) {
+        //nothing left to end in SQLite, only the savepoint marks
+        ret = do_commit ? -ECANCELED : 0;
+        if (parent == nullptr) {
+            sw.savepoint_marks.clear();
+            lock.reset();
+        } else {
+            if (!sw.savepoint_marks.empty())
+                sw.savepoint_marks.pop_back();
+            parent->children--;
+        }
+    } else if (parent == nullptr) {
+        ret = sw.__exec(do_commit ? "COMMIT;" : "ROLLBACK;");
+        //a failed commit keeps the transaction open, for a later rollback
+        if (ret != 0 && do_commit)
+            return ret;
+        sw.savepoint_marks.clear();
+        lock.reset();
+    } else {
+        ret = do_commit ? sw.__release(savepoint) :
+            sw.__rollback_to(savepoint);
+        parent->children--;
+    }
+    active = false;
+    return trace.done(ret, {}, nullptr, depth);
+}
+
+bool SqliteWrapper::Transaction::peek_entry(const std::string &table_name,
+            const std::string &sql_part)
+{
+    if (!is_ok())
+        return false;
+    TraceScope trace(&sw, TRACE_PEEK_ENTRY);
+    Deadline deadline(&sw);
+    OpScope op(&sw, OP_PEEK_ENTRY);
+    bool found = sw.__peek_entry(table_name, sql_part);
+
+    return trace.done(settle(deadline.result(found)) == 1,
+            {&table_name, &sql_part});
+}
+
+int SqliteWrapper::Transaction::insert_entry(const std::string &table_name,
+        const std::string &sql_part,
+        std::map<const std::string, std::vector<uint8_t>*> *blobs)
+{
+    if (!is_ok())
+        return -EINVAL;
+    TraceScope trace(&sw, TRACE_INSERT_ENTRY);
+    Deadline deadline(&sw);
+    OpScope op(&sw, OP_INSERT_ENTRY);
+    int ret = deadline.result(sw.__insert_entry(table_name, sql_part, blobs));
+
+    return trace.done(settle(ret), {&table_name, &sql_part}, blobs);
+}
+
+int SqliteWrapper::Transaction::update_entry(const std::string &table_name,
+            const std::string &sql_part_update,
+            const std::string &sql_part_filter,
+            std::map<const std::string, std::vector<uint8_t>*> *blobs)
+{
+    if (!is_ok())
+        return -EINVAL;
+    TraceScope trace(&sw, TRACE_UPDATE_ENTRY);
+    Deadline deadline(&sw);
+    OpScope op(&sw, OP_UPDATE_ENTRY);
+    int ret = deadline.result(sw.__update_entry(table_name,
+                sql_part_update, sql_part_filter, blobs));
+
+    return trace.done(settle(ret),
+            {&table_name, &sql_part_update, &sql_part_filter}, blobs);
+}
+
+int SqliteWrapper::Transaction::insert_update_entry(
+            const std::string &table_name,
+            const std::string &sql_part_insert,
+            const std::string &sql_part_update,
+            const std::string &sql_part_filter,
+            std::map<const std::string, std::vector<uint8_t>*> *blobs)
+{
+    if (!is_ok())
+        return -EINVAL;
+    TraceScope trace(&sw, TRACE_INSERT_UPDATE_ENTRY);
+    Deadline deadline(&sw);
+    OpScope op(&sw, OP_INSERT_UPDATE_ENTRY);
+    int ret = deadline.result(sw.__insert_update_entry(table_name,
+                sql_part_insert, sql_part_update, sql_part_filter, blobs));
+
+    return trace.done(settle(ret),
+            {&table_name, &sql_part_insert, &sql_part_update,
+            &sql_part_filter}, blobs);
+}
+
+int SqliteWrapper::Transaction::delete_entry(const std::string &table_name,
+            const std::string &sql_part)
+{
+    if (!is_ok())
+        return -EINVAL;
+    TraceScope trace(&sw, TRACE_DELETE_ENTRY);
+    Deadline deadline(&sw);
+    OpScope op(&sw, OP_DELETE_ENTRY);
+    int ret = deadline.result(sw.__delete_entry(table_name, sql_part));
+
+    return trace.done(settle(ret), {&table_name, &sql_part});
+}
+
+int SqliteWrapper::Transaction::delete_all_entry(const std::string &table_name)
+{
+    if (!is_ok())
+        return -EINVAL;
+    TraceScope trace(&sw, TRACE_DELETE_ALL_ENTRY);
+    Deadline deadline(&sw);
+    OpScope op(&sw, OP_DELETE_ALL_ENTRY);
+    int ret = deadline.result(sw.__delete_all_entry(table_name));
+
+    return trace.done(settle(ret), {&table_name});
+}
+
+int SqliteWrapper::Transaction::get_entry(std::vector<GetItem> &out,
+            const std::string &table_name,
+            const std::string &sql_values,
+            const std::string &sql_filter)
+{
+    if (!is_ok())
+        return -EINVAL;
+    TraceScope trace(&sw, TRACE_GET_ENTRY);
+    Deadline deadline(&sw);
+    OpScope op(&sw, OP_GET_ENTRY);
+    int ret = deadline.result(sw.__get_entry(out, table_name, sql_values,
+                sql_filter));
+
+    return trace.done(settle(ret),
+            {&table_name, &sql_values, &sql_filter}, nullptr, out.size());
+}
+
+int SqliteWrapper::Transaction::count_entries(int64_t &count,
+        const std::string &table_name, const std::string &sql_filter)
+{
+    if (!is_ok())
+        return -EINVAL;
+    TraceScope trace(&sw, TRACE_COUNT_ENTRIES);
+    Deadline deadline(&sw);
+    OpScope op(&sw, OP_COUNT_ENTRIES);
+    int ret = deadline.result(sw.__count_entries(count, table_name,
+                sql_filter));
+
+    return trace.done(settle(ret), {&table_name, &sql_filter});
+}
+
+int SqliteWrapper::Transaction::exists(const std::string &table_name,
+        const std::string &sql_filter)
+{
+    if (!is_ok())
+        return -EINVAL;
+    TraceScope trace(&sw, TRACE_EXISTS);
+    Deadline deadline(&sw);
+    OpScope op(&sw, OP_EXISTS);
+    int ret = deadline.result(sw.__exists(table_name, sql_filter));
+
+    return trace.done(settle(ret), {&table_name, &sql_filter});
+}
+
+int SqliteWrapper::Transaction::aggregate(Value &result,
+        const std::string &table_name, AggregateFn fn,
+        const std::string &column, const std::string &sql_filter)
+{
+    if (!is_ok())
+        return -EINVAL;
+    TraceScope trace(&sw, TRACE_AGGREGATE);
+    Deadline deadline(&sw);
+    OpScope op(&sw, OP_AGGREGATE);
+    int ret = deadline.result(sw.__aggregate(result, table_name, fn, column,
+                sql_filter));
+
+    return trace.done(settle(ret),
+            {&table_name, &column, &sql_filter}, nullptr, fn);
+}
+
+static std::mutex allocator_mutex;
+static PoolAllocator *pool_allocator = nullptr;
+static uint32_t pool_thread_cache_blocks = 0;
+
+int SqliteWrapper::install_allocator(const AllocatorConfig &config)
+{
+    std::lock_guard<std::mutex> lock(allocator_mutex);
+    sqlite3_mem_methods mem;
+    PoolAllocator *pools;
+    int rc;
+
+    if (config.soft_heap_limit < 0 || config.hard_heap_limit < 0)
+        return -EINVAL;
+    //the installed pools stay, only a config keeping them is accepted
+    if (pool_allocator != nullptr && (!config.pools ||
+                config.thread_cache_blocks != pool_thread_cache_blocks))
+        return -EBUSY;
+    if (config.pools && pool_allocator == nullptr) {
+        /* SQLite may keep its blocks until exit, the pools are never freed */
+        pools = new PoolAllocator(config.thread_cache_blocks);
+        pools->methods(mem);
+        if ((rc = sqlite3_config(SQLITE_CONFIG_MALLOC, &mem)) != SQLITE_OK) {
+            TB_LOG_ERROR("Can't install the pool allocator: %s, SQLite "
+                    "already initialized", sqlite3_errstr(rc));
+            delete pools;
+            return -EBUSY;
+        }
+        pool_allocator = pools;
+        pool_thread_cache_blocks = config.thread_cache_blocks;
+    }
+    sqlite3_hard_heap_limit64(config.hard_heap_limit);
+    sqlite3_soft_heap_limit64(config.soft_heap_limit);
+    return 0;
+}
+
+void SqliteWrapper::get_memory_stats(MemoryStats &stats, bool reset_high_water)
+{
+    std::lock_guard<std::mutex> lock(allocator_mutex);
+
+    stats.used = sqlite3_memory_used();
+    stats.high_water = sqlite3_memory_highwater(reset_high_water);
+    stats.pool_reserved = pool_allocator ? pool_allocator->reserved() : 0;
+    stats.soft_heap_limit = sqlite3_soft_heap_limit64(-1);
+    stats.hard_heap_limit = sqlite3_hard_heap_limit64(-1);
+}
+
+int SqliteWrapper::get_io_stats(IoStats &stats)
+{
+    if (io_vfs == nullptr)
+        return -EINVAL;
+    io_vfs->snapshot(stats);
+    return 0;
+}
+
+void SqliteWrapper::reset_io_stats(void)
+{
+    if (io_vfs != nullptr)
+        io_vfs->reset();
+}
+
+int SqliteWrapper::get_sched_stats(SchedStats &stats)
+{
+    if (scheduler == nullptr)
+        return -EINVAL;
+    scheduler->snapshot(stats);
+    return 0;
+}
+
+void SqliteWrapper::reset_sched_stats(void)
+{
+    if (scheduler != nullptr)
+        scheduler->reset();
+}
+
+int SqliteWrapper::start_trace(const std::string &path)
+{
+    auto writer = std::make_shared<TraceWriter>();
+    int ret;
+
+    if ((ret = writer->open(path)) != 0)
+        return ret;
+    std::atomic_store(&tracer, writer);
+    tracing.store(true, std::memory_order_release);
+    return 0;
+}
+
+void SqliteWrapper::stop_trace(void)
+{
+    tracing.store(false, std::memory_order_release);
+    //calls still in flight keep their own reference to the writer
+    std::atomic_store(&tracer, std::shared_ptr<TraceWriter>());
+}
+
+SqliteWrapper::TraceScope::TraceScope(SqliteWrapper *sw, uint8_t method) :
+    method(method)
+{
+    if (!sw->tracing.load(std::memory_order_acquire))
+        return;
+    tracer = std::atomic_load(&sw->tracer);
+    if (tracer != nullptr)
+        start_ns = tracer->now_ns();
+}
+
+int SqliteWrapper::TraceScope::done(int result,
+        std::initializer_list<const std::string *> args,
+        std::map<const std::string, std::vector<uint8_t>*> *blobs,
+        uint32_t aux)
+{
+    TraceRecord record;
+
+    if (tracer == nullptr)
+        return result;
+    record.method = method;
+    record.aux = aux;
+    record.result = result;
+    record.ts_ns = start_ns;
+    record.duration_ns = tracer->now_ns() - start_ns;
+    for (auto arg : args)
+        record.args.push_back(*arg);
+    if (blobs != nullptr) {
+        for (auto const &itr : *blobs)
+            record.blobs.push_back(TraceBlob{itr.first,
+                    (uint32_t)itr.second->size(),
+                    fnv1a_64(itr.second->data(), itr.second->size())});
+    }
+    tracer->write(record);
+    return result;
+}
+
+int SqliteWrapper::__create_function(const std::string &name, int nargs,
+        bool deterministic, void *app,
+        void (*func)(sqlite3_context *, int, sqlite3_value **),
+        void (*step)(sqlite3_context *, int, sqlite3_value **),
+        void (*final)(sqlite3_context *),
+        void (*destroy)(void *))
+{
+    //taken first, as by the parallel scans, they may call the replaced app
+    std::unique_lock<std::shared_timed_mutex> fn_lock(functions_mutex);
+    ConnLock lock(this);
+    int flags = SQLITE_UTF8 | (deterministic ? SQLITE_DETERMINISTIC : 0);
+
+    //on failure SQLite already released app through destroy
+    if (sqlite3_create_function_v2(db, name.c_str(), nargs, flags, app,
+                func, step, final, destroy) != SQLITE_OK)
+    {
+        TB_LOG_ERROR("register function %s failed: %s", name.c_str(),
+                sqlite3_errmsg(db));
+        return -EINVAL;
+    }
+    functions[std::make_pair(name, nargs)] =
+        FunctionDef{nargs, flags, app, func, step, final};
+    return 0;
+}
+
+int SqliteWrapper::__exec(const std::string &sql_str)
+{
+    size_t change_mark = change_pending.size();
+    char *err_msg = NULL;
+
+    if (sqlite3_exec(db, sql_str.c_str(), 0, 0, &err_msg) != SQLITE_OK)
+    {
+        TB_LOG_ERROR("exec \"%s\" err: %s", sql_str.c_str(), err_msg);
+        sqlite3_free(err_msg);
+        __drop_changes(change_mark);
+        return -EAGAIN;
+    }
+    return 0;
+}
+
+/*
+ * A failing statement inside a transaction only undoes its own rows, which
+ * fires no rollback hook: drop the events it recorded since mark.
+ */
+void SqliteWrapper::__drop_changes(size_t mark)
+{
+    if (mark < change_pending.size())
+        change_pending.resize(mark);
+}
+
+/*
+ * Savepoints issued by the wrapper remember how many change events were
+ * pending when they started, so that rolling one back also drops the events
+ * of the rows it undid.
+ */
+int SqliteWrapper::__savepoint(const std::string &name)
+{
+    int ret = __exec("SAVEPOINT " + name + ";");
+
+    if (ret == 0)
+        savepoint_marks.push_back(change_pending.size());
+    return ret;
+}
+
+int SqliteWrapper::__release(const std::string &name)
+{
+    if (!savepoint_marks.empty())
+        savepoint_marks.pop_back();
+    return __exec("RELEASE " + name + ";");
+}
+
+int SqliteWrapper::__rollback_to(const std::string &name)
+{
+    int ret = __exec("ROLLBACK TO " + name + ";");
+
+    if (!savepoint_marks.empty()) {
+        __drop_changes(savepoint_marks.back());
+        savepoint_marks.pop_back();
+    }
+    if (ret == 0)
+        ret = __exec("RELEASE " + name + ";");
+    return ret;
+}
+
+static void change_update_hook(void *arg, int op, const char *db_name,
+        const char *table_name, sqlite3_int64 rowid)
+{
+    auto pending = (std::vector<ChangeEvent> *)arg;
+    ChangeEvent event;
+
+    (void)db_name;
+    //internal tables of the wrapper are not published
+    if (strncmp(table_name, "__sw_", 5) == 0)
+        return;
+    event.op = op;
+    event.rowid = rowid;
+    strncpy(event.table, table_name, sizeof(event.table) - 1);
+    event.table[sizeof(event.table) - 1] = '\0';
+    pending->push_back(event);
+}
+
+int SqliteWrapper::change_commit_hook(void *arg)
+{
+    auto sw = (SqliteWrapper *)arg;
+
+    for (auto const &event : sw->change_pending)
+        sw->change_ring->publish(event);
+    sw->change_pending.clear();
+    return 0;
+}
+
+void SqliteWrapper::change_rollback_hook(void *arg)
+{
+    auto sw = (SqliteWrapper *)arg;
+
+    sw->change_pending.clear();
+    sw->savepoint_marks.clear();
+}
+
+int SqliteWrapper::enable_change_capture(size_t capacity)
+{
+    ConnLock lock(this);
+
+    if (change_ring != nullptr)
+        return 0;
+    if (capacity == 0)
+        return -EINVAL;
+    change_ring = std::make_shared<ChangeRing>(capacity);
+    sqlite3_update_hook(db, change_update_hook, &change_pending);
+    sqlite3_commit_hook(db, change_commit_hook, this);
+    sqlite3_rollback_hook(db, change_rollback_hook, this);
+    return 0;
+}
+
+int SqliteWrapper::subscribe_changes(std::unique_ptr<ChangeRing::Reader> &reader)
+{
+    ConnLock lock(this);
+
+    if (change_ring == nullptr)
+        return -EINVAL;
+    reader.reset(new ChangeRing::Reader(change_ring));
+    return 0;
+}
+
+int SqliteWrapper::set_ttl(const std::string &table_name,
+        const std::string &ts_column, uint32_t ttl_sec, uint32_t chunk_rows)
+{
+    ConnLock lock(this);
+
+    if (ttl_sec == 0) {
+        ttl_rules.erase(table_name);
+        return 0;
+    }
+    if (ts_column.empty() || chunk_rows == 0)
+        return -EINVAL;
+    ttl_rules[table_name] = TtlRule{ts_column, ttl_sec, chunk_rows};
+    return 0;
+}
+
+int64_t SqliteWrapper::reap_expired(void)
+{
+    std::map<std::string, TtlRule> rules;
+    int64_t now = (int64_t)time(nullptr);
+    int64_t total = 0;
+    int64_t ret;
+
+    {
+        ConnLock lock(this);
+        rules = ttl_rules;
+    }
+    for (auto const &itr : rules) {
+        auto const &rule = itr.second;
+        int64_t after = INT64_MIN;
+
+        do {
+            {
+                ConnLock lock(this, OP_REAPER);
+                ret = __reap_chunk(itr.first, rule.ts_column,
+                        now - rule.ttl_sec, rule.chunk_rows, after);
+            }
+            if (ret < 0)
+                return ret;
+            total += ret;
+            std::this_thread::yield();
+        } while ((uint32_t)ret == rule.chunk_rows);
+    }
+    return total;
+}
+
+/*
+ * Delete the first chunk_rows expired rows past rowid after, in rowid order,
+ * as a single rowid range; after moves to the end of the range so the next
+ * chunk starts there instead of rescanning the rows kept. Return the number
+ * of rows deleted.
+ */
+int64_t SqliteWrapper::__reap_chunk(const std::string &table_name,
+        const std::string &ts_column, int64_t cutoff, uint32_t chunk_rows,
+        int64_t &after)
+{
+    std::string sql_str = "SELECT rowid FROM " + table_name +
+        " WHERE rowid > ? AND " + ts_column + " < ? ORDER BY rowid LIMIT ?;";
+    sqlite3_stmt *stmt;
+    int64_t first = 0;
+    int64_t last = 0;
+    int64_t count = 0;
+    int ret = 0;
+
+    if (sqlite3_prepare_v2(db, sql_str.c_str(), -1, &stmt, NULL) != SQLITE_OK)
+    {
+        TB_LOG_ERROR("sqlite3 prepare failed");
+        return -EINVAL;
+    }
+    sqlite3_bind_int64(stmt, 1, after);
+    sqlite3_bind_int64(stmt, 2, cutoff);
+    sqlite3_bind_int64(stmt, 3, chunk_rows);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        last = sqlite3_column_int64(stmt, 0);
+        if (count++ == 0)
+            first = last;
+    }
+    sqlite3_finalize(stmt);
+    if (count == 0)
+        return 0;
+
+    ret = __delete_entry(table_name, "WHERE rowid BETWEEN " +
+            std::to_string(first) + " AND " + std::to_string(last) +
+            " AND " + ts_column + " < " + std::to_string(cutoff));
+    if (ret < 0)
+        return ret;
+    after = last;
+    return count;
+}
+
+int SqliteWrapper::start_reaper(uint32_t interval_ms)
+{
+    std::unique_lock<std::mutex> lock(reaper_mutex);
+
+    if (lock_policy == LOCK_NONE)
+        return -EINVAL;
+    if (reaper_thread.joinable())
+        return -EBUSY;
+    reaper_stop = false;
+    reaper_thread = std::thread([this, interval_ms]() {
+        std::unique_lock<std::mutex> lock(reaper_mutex);
+
+        while (!reaper_cv.wait_for(lock,
+                    std::chrono::milliseconds(interval_ms),
+                    [this]() { return reaper_stop; })) {
+            lock.unlock();
+            if (reap_expired() < 0)
+                TB_LOG_WARNING("TTL reaper pass failed");
+            lock.lock();
+        }
+    });
+    return 0;
+}
+
+void SqliteWrapper::stop_reaper(void)
+{
+    {
+        std::unique_lock<std::mutex> lock(reaper_mutex);
+        reaper_stop = true;
+    }
+    reaper_cv.notify_all();
+    if (reaper_thread.joinable())
+        reaper_thread.join();
+}
+
+/*
+ * Called by the committing call, under the wrapper lock. Past the hard limit
+ * it checkpoints itself, as the SQLite auto checkpoint would.
+ */
+int SqliteWrapper::wal_frames_hook(void *arg, sqlite3 *db,
+        const char *db_name, int frames)
+{
+    auto sw = (SqliteWrapper *)arg;
+    int log = 0;
+    int ckpt = 0;
+
+    sw->wal_frames.store(frames, std::memory_order_relaxed);
+    if (frames < (int)sw->maint_config.checkpoint_hard_frames)
+        return SQLITE_OK;
+    if (sqlite3_wal_checkpoint_v2(db, db_name, SQLITE_CHECKPOINT_PASSIVE,
+                &log, &ckpt) != SQLITE_OK) {
+        TB_LOG_WARNING("hard limit checkpoint failed: %s",
+                sqlite3_errmsg(db));
+        return SQLITE_OK;
+    }
+    sw->wal_frames.store(log - ckpt, std::memory_order_relaxed);
+    return SQLITE_OK;
+}
+
+int SqliteWrapper::start_maintenance(const MaintenanceConfig &config)
+{
+    std::unique_lock<std::mutex> lock(maint_mutex);
+
+    if (lock_policy == LOCK_NONE)
+        return -EINVAL;
+    if (maint_thread.joinable())
+        return -EBUSY;
+    maint_config = config;
+    maint_stop = false;
+    if (config.checkpoint_min_frames > 0) {
+        ConnLock conn_lock(this);
+        sqlite3_stmt *stmt;
+
+        //restored by stop_maintenance
+        if (sqlite3_prepare_v2(db, "PRAGMA wal_autocheckpoint;", -1, &stmt,
+                    NULL) == SQLITE_OK) {
+            if (sqlite3_step(stmt) == SQLITE_ROW)
+                maint_autocheckpoint = sqlite3_column_int(stmt, 0);
+            sqlite3_finalize(stmt);
+        }
+        //replaces the auto checkpoint: foreground commits never checkpoint
+        sqlite3_wal_hook(db, wal_frames_hook, this);
+    }
+    maint_thread = std::thread([this]() {
+        std::unique_lock<std::mutex> lock(maint_mutex);
+        int64_t now = steady_ms();
+        int64_t last_optimize = now;
+        int64_t last_vacuum = now;
+        uint32_t tick = std::max(10u, std::min(maint_config.idle_ms, 100u));
+
+        while (!maint_cv.wait_for(lock, std::chrono::milliseconds(tick),
+                    [this]() { return maint_stop; })) {
+            auto const &cfg = maint_config;
+            bool idle;
+
+            now = steady_ms();
+            idle = now - last_activity_ms.load(std::memory_order_relaxed) >=
+                cfg.idle_ms;
+            lock.unlock();
+            if (idle && cfg.checkpoint_min_frames > 0 &&
+                    wal_frames >= (int)cfg.checkpoint_min_frames)
+                __maint_checkpoint();
+            if (idle && cfg.optimize_interval_ms > 0 &&
+                    now - last_optimize >= cfg.optimize_interval_ms) {
+                if (__maint_optimize() == 0)
+                    last_optimize = now;
+            }
+            if (idle && cfg.vacuum_interval_ms > 0 &&
+                    now - last_vacuum >= cfg.vacuum_interval_ms) {
+                if (__maint_vacuum() == 0)
+                    last_vacuum = now;
+            }
+            lock.lock();
+        }
+    });
+    return 0;
+}
+
+int SqliteWrapper::start_maintenance(void)
+{
+    return start_maintenance(MaintenanceConfig());
+}
+
+void SqliteWrapper::stop_maintenance(void)
+{
+    bool was_running;
+
+    {
+        std::unique_lock<std::mutex> lock(maint_mutex);
+        maint_stop = true;
+    }
+    maint_cv.notify_all();
+    was_running = maint_thread.joinable();
+    if (was_running)
+        maint_thread.join();
+    if (was_running && maint_config.checkpoint_min_frames > 0) {
+        ConnLock lock(this);
+        sqlite3_wal_autocheckpoint(db, maint_autocheckpoint);
+    }
+}
+
+int SqliteWrapper::backup_to(const std::string &path, uint32_t pages_per_step,
+        uint32_t sleep_between_ms,
+        std::function<void(const BackupProgress &)> progress)
+{
+    std::unique_lock<std::mutex> lock(backup_mutex);
+
+    if (lock_policy == LOCK_NONE || path.empty() || pages_per_step == 0)
+        return -EINVAL;
+    if (backup_started && !backup_state.done)
+        return -EBUSY;
+    //the last backup thread is done, only left to join
+    if (backup_thread.joinable())
+        backup_thread.join();
+    backup_stop = false;
+    backup_started = true;
+    backup_state = BackupProgress();
+    backup_thread = std::thread([this, path, pages_per_step,
+            sleep_between_ms, progress]() {
+        __backup_run(path, pages_per_step, sleep_between_ms, progress);
+    });
+    return 0;
+}
+
+int SqliteWrapper::wait_backup(void)
+{
+    std::unique_lock<std::mutex> lock(backup_mutex);
+
+    if (!backup_started)
+        return -ENOENT;
+    backup_cv.wait(lock, [this]() { return backup_state.done; });
+    return backup_state.result;
+}
+
+int SqliteWrapper::get_backup_progress(BackupProgress &progress)
+{
+    std::unique_lock<std::mutex> lock(backup_mutex);
+
+    if (!backup_started)
+        return -ENOENT;
+    progress = backup_state;
+    return 0;
+}
+
+void SqliteWrapper::cancel_backup(void)
+{
+    {
+        std::unique_lock<std::mutex> lock(backup_mutex);
+        backup_stop = true;
+    }
+    backup_cv.notify_all();
+    if (backup_thread.joinable())
+        backup_thread.join();
+}
+
+void SqliteWrapper::__backup_report(const BackupProgress &state,
+        const std::function<void(const BackupProgress &)> &progress)
+{
+    //the callback runs first: wait_backup returns after the last one
+    if (progress != nullptr)
+        progress(state);
+    {
+        std::unique_lock<std::mutex> lock(backup_mutex);
+        backup_state = state;
+    }
+    if (state.done)
+        backup_cv.notify_all();
+}
+
+/*
+ * Backup thread. The wrapper lock is only held for a single step: between
+ * steps the wrapper connection may write, SQLite then updates the pages
+ * already copied, or starts over if another connection wrote.
+ */
+int SqliteWrapper::__backup_run(const std::string &path,
+        uint32_t pages_per_step, uint32_t sleep_between_ms,
+        const std::function<void(const BackupProgress &)> &progress)
+{
+    std::string tmp_path = path + ".XXXXXX";
+    sqlite3 *dest = nullptr;
+    sqlite3_backup *backup = nullptr;
+    BackupProgress state;
+    int prev_remaining = -1;
+    int ret = 0;
+    int fd;
+    int rc;
+
+    //a unique name, an existing file next to path is never touched
+    if ((fd = mkstemp(&tmp_path[0])) < 0)
+    {
+        ret = -errno;
+        TB_LOG_ERROR("Can't create backup next to %s", path.c_str());
+        tmp_path.clear();
+        goto END;
+    }
+    close(fd);
+    if (sqlite3_open_v2(tmp_path.c_str(), &dest, SQLITE_OPEN_READWRITE |
+                SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, nullptr) !=
+            SQLITE_OK)
+    {
+        TB_LOG_ERROR("Can't open backup %s: %s", tmp_path.c_str(),
+                sqlite3_errmsg(dest));
+        ret = -EIO;
+        goto END;
+    }
+    {
+        ConnLock lock(this, OP_BACKUP);
+        backup = sqlite3_backup_init(dest, "main", db, "main");
+    }
+    if (backup == nullptr)
+    {
+        TB_LOG_ERROR("backup init failed: %s", sqlite3_errmsg(dest));
+        ret = -EINVAL;
+        goto END;
+    }
+
+    while (true) {
+        {
+            ConnLock lock(this, OP_BACKUP);
+            rc = sqlite3_backup_step(backup, (int)pages_per_step);
+            state.remaining = sqlite3_backup_remaining(backup);
+            state.pagecount = sqlite3_backup_pagecount(backup);
+        }
+        //pages written through the wrapper only grow remaining, a restart
+        //also brings it back to at most one step copied
+        if (prev_remaining >= 0 && state.remaining > prev_remaining &&
+                state.pagecount - state.remaining <= (int)pages_per_step)
+            state.restarts++;
+        prev_remaining = state.remaining;
+        if (rc == SQLITE_DONE)
+            break;
+        //busy or locked: the copy is retried on the next step
+        if (rc != SQLITE_OK && rc != SQLITE_BUSY && rc != SQLITE_LOCKED)
+        {
+            TB_LOG_ERROR("backup step failed: %s", sqlite3_errstr(rc));
+            ret = -EIO;
+            break;
+        }
+        __backup_report(state, progress);
+
+        std::unique_lock<std::mutex> lock(backup_mutex);
+        if (backup_cv.wait_for(lock,
+                    std::chrono::milliseconds(sleep_between_ms),
+                    [this]() { return backup_stop; })) {
+            ret = -ECANCELED;
+            break;
+        }
+    }
+END:
+    if (backup != nullptr) {
+        ConnLock lock(this, OP_BACKUP);
+        sqlite3_backup_finish(backup);
+    }
+    sqlite3_close(dest);
+    if (ret == 0 && rename(tmp_path.c_str(), path.c_str()) != 0) {
+        ret = -errno;
+        TB_LOG_ERROR("Can't rename backup to %s", path.c_str());
+    }
+    if (ret != 0)
+        remove(tmp_path.c_str());
+    state.done = true;
+    state.result = ret;
+    __backup_report(state, progress);
+    return ret;
+}
+
+int SqliteWrapper::prewarm(const std::vector<std::string> &names,
+        bool readahead)
+{
+    {
+        std::unique_lock<std::mutex> lock(prewarm_mutex);
+
+        if (prewarm_started && !prewarm_state.done)
+            return -EBUSY;
+        prewarm_stop = false;
+        prewarm_started = true;
+        prewarm_state = PrewarmProgress();
+    }
+    return __prewarm_run(names, readahead, false, nullptr);
+}
+
+int SqliteWrapper::start_prewarm(const std::vector<std::string> &names,
+        bool readahead, std::function<void(const PrewarmProgress &)> progress)
+{
+    std::unique_lock<std::mutex> lock(prewarm_mutex);
+
+    if (lock_policy == LOCK_NONE)
+        return -EINVAL;
+    if (prewarm_started && !prewarm_state.done)
+        return -EBUSY;
+    //the last prewarm thread is done, only left to join
+    if (prewarm_thread.joinable())
+        prewarm_thread.join();
+    prewarm_stop = false;
+    prewarm_started = true;
+    prewarm_state = PrewarmProgress();
+    prewarm_thread = std::thread([this, names, readahead, progress]() {
+        __prewarm_run(names, readahead, true, progress);
+    });
+    return 0;
+}
+
+int SqliteWrapper::wait_prewarm(void)
+{
+    std::unique_lock<std::mutex> lock(prewarm_mutex);
+
+    if (!prewarm_started)
+        return -ENOENT;
+    prewarm_cv.wait(lock, [this]() { return prewarm_state.done; });
+    return prewarm_state.result;
+}
+
+int SqliteWrapper::get_prewarm_progress(PrewarmProgress &progress)
+{
+    std::unique_lock<std::mutex> lock(prewarm_mutex);
+
+    if (!prewarm_started)
+        return -ENOENT;
+    progress = prewarm_state;
+    return 0;
+}
+
+void SqliteWrapper::cancel_prewarm(void)
+{
+    {
+        std::unique_lock<std::mutex> lock(prewarm_mutex);
+        prewarm_stop = true;
+    }
+    prewarm_cv.notify_all();
+    if (prewarm_thread.joinable())
+        prewarm_thread.join();
+}
+
+void SqliteWrapper::__prewarm_report(const PrewarmProgress &state,
+        const std::function<void(const PrewarmProgress &)> &progress)
+{
+    //the callback runs first: wait_prewarm returns after the last one
+    if (progress != nullptr)
+        progress(state);
+    {
+        std::unique_lock<std::mutex> lock(prewarm_mutex);
+        prewarm_state = state;
+    }
+    if (state.done)
+        prewarm_cv.notify_all();
+}
+
+/*
+ * Hand the whole database file and WAL to the kernel readahead: the b-tree
+ * walks then read from the OS cache instead of seeking page by page
+ */
+void SqliteWrapper::__prewarm_readahead(void)
+{
+    const char *file = sqlite3_db_filename(db, "main");
+    const char *paths[2];
+
+    if (file == nullptr || *file == '\0')
+        return;
+    paths[0] = file;
+    paths[1] = sqlite3_filename_wal(file);
+    for (auto path : paths) {
+        int fd;
+
+        if (path == nullptr || (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+            continue;
+        if (posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED) != 0)
+            TB_LOG_DEBUG("readahead of %s refused", path);
+        close(fd);
+    }
+}
+
+/*
+ * Walk every page of the b-tree of name, overflow pages included: dbstat
+ * reads them through the pager of the connection. A table or index has at
+ * least its root page, no page at all means no such name.
+ */
+int SqliteWrapper::__prewarm_object(const std::string &name, int64_t &pages)
+{
+    const char *sql = "SELECT count(*) FROM dbstat WHERE name = ?1;";
+    sqlite3_stmt *stmt = nullptr;
+    int ret = 0;
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK)
+    {
+        TB_LOG_ERROR("prewarm needs the dbstat table: %s",
+                sqlite3_errmsg(db));
+        ret = -ENOTSUP;
+        goto END;
+    }
+    sqlite3_bind_text(stmt, 1, name.c_str(), name.size(), SQLITE_STATIC);
+    if (sqlite3_step(stmt) != SQLITE_ROW)
+    {
+        TB_LOG_ERROR("sqlite3 step failed: %s", sqlite3_errmsg(db));
+        ret = -EIO;
+        goto END;
+    }
+    pages = sqlite3_column_int64(stmt, 0);
+    if (pages == 0)
+    {
+        TB_LOG_ERROR("No table or index %s to prewarm", name.c_str());
+        ret = -ENOENT;
+    }
+END:
+    sqlite3_finalize(stmt);
+    return ret;
+}
+
+/*
+ * The foreground prewarm queues for the connection like any read; the
+ * background one only takes it while free, like the maintenance jobs, and
+ * polls until then.
+ */
+int SqliteWrapper::__prewarm_run(const std::vector<std::string> &names,
+        bool readahead, bool background,
+        const std::function<void(const PrewarmProgress &)> &progress)
+{
+    PrewarmProgress state;
+    Value cache_size, page_size;
+    int64_t cache_pages = 0;
+    int64_t pages;
+    int ret = 0;
+
+    state.objects = names.size();
+    __prewarm_report(state, progress);
+    if (readahead)
+        __prewarm_readahead();
+    for (size_t i = 0; i < names.size(); i++) {
+        while (true) {
+            {
+                ConnLock lock(this, OP_PREWARM, background);
+
+                if (lock.owns_lock()) {
+                    ret = __prewarm_object(names[i], pages);
+                    if (ret == 0 && cache_pages == 0 &&
+                            __scalar("PRAGMA cache_size;", cache_size) == 0 &&
+                            __scalar("PRAGMA page_size;", page_size) == 0)
+                        cache_pages = cache_size.i >= 0 ? cache_size.i :
+                            -cache_size.i * 1024 / page_size.i;
+                    break;
+                }
+            }
+            std::unique_lock<std::mutex> lock(prewarm_mutex);
+            if (prewarm_cv.wait_for(lock, std::chrono::milliseconds(1),
+                        [this]() { return prewarm_stop; })) {
+                ret = -ECANCELED;
+                break;
+            }
+        }
+        if (ret != 0)
+            break;
+        state.objects_done++;
+        state.pages += pages;
+        if (i + 1 < names.size())
+            __prewarm_report(state, progress);
+        std::unique_lock<std::mutex> lock(prewarm_mutex);
+        if (prewarm_stop) {
+            ret = -ECANCELED;
+            break;
+        }
+    }
+    if (ret == 0 && state.pages > cache_pages)
+        TB_LOG_WARNING("Prewarmed %lld pages, the page cache only holds %lld:"
+                " raise PRAGMA cache_size", (long long)state.pages,
+                (long long)cache_pages);
+    state.done = true;
+    state.result = ret;
+    __prewarm_report(state, progress);
+    return ret;
+}
+
+/*
+ * Maintenance jobs never queue for the connection: they only run when the
+ * lock is free, and give it back between two steps as soon as a foreground
+ * call waits for it. Return -EBUSY when preempted.
+ */
+int SqliteWrapper::__maint_checkpoint(void)
+{
+    ConnLock lock(this, OP_MAINTENANCE, true);
+    uint32_t budget_ms = maint_config.checkpoint_budget_ms;
+    std::thread watchdog;
+    int log = 0;
+    int ckpt = 0;
+    int rc;
+
+    if (!lock.owns_lock())
+        return -EBUSY;
+    ckpt_running = true;
+    if (fg_waiting.load(std::memory_order_relaxed) > 0) {
+        ckpt_running = false;
+        return -EBUSY;
+    }
+    if (budget_ms > 0)
+        watchdog = std::thread([this, budget_ms]() {
+            std::unique_lock<std::mutex> ckpt_lock(ckpt_mutex);
+
+            if (!ckpt_cv.wait_for(ckpt_lock,
+                        std::chrono::milliseconds(budget_ms),
+                        [this]() { return !ckpt_running; }))
+                sqlite3_interrupt(db);
+        });
+    rc = sqlite3_wal_checkpoint_v2(db, nullptr, SQLITE_CHECKPOINT_PASSIVE,
+            &log, &ckpt);
+    {
+        std::unique_lock<std::mutex> ckpt_lock(ckpt_mutex);
+        ckpt_running = false;
+    }
+    ckpt_cv.notify_all();
+    if (watchdog.joinable())
+        watchdog.join();
+    //the pages copied so far are copied again by the next run
+    if (rc == SQLITE_INTERRUPT)
+        return -EBUSY;
+    if (rc != SQLITE_OK) {
+        TB_LOG_WARNING("passive checkpoint failed: %s", sqlite3_errmsg(db));
+        return -EAGAIN;
+    }
+    wal_frames = log - ckpt;
+    return 0;
+}
+
+/*
+ * A foreground call about to wait for the connection interrupts the running
+ * maintenance checkpoint. Only done under ckpt_mutex while the checkpoint
+ * runs, so the interrupt never reaches a foreground statement.
+ */
+void SqliteWrapper::__preempt_checkpoint(void)
+{
+    std::unique_lock<std::mutex> ckpt_lock(ckpt_mutex, std::defer_lock);
+
+    if (!ckpt_running.load(std::memory_order_relaxed))
+        return;
+    ckpt_lock.lock();
+    if (ckpt_running)
+        sqlite3_interrupt(db);
+}
+
+int SqliteWrapper::__maint_optimize(void)
+{
+    ConnLock lock(this, OP_MAINTENANCE, true);
+
+    if (!lock.owns_lock())
+        return -EBUSY;
+    return __exec("PRAGMA analysis_limit = " +
+            std::to_string(maint_config.analysis_limit) +
+            "; PRAGMA optimize;");
+}
+
+/*
+ * Incremental vacuum only applies to databases in auto_vacuum = INCREMENTAL
+ * mode, it is a no-op otherwise.
+ */
+int SqliteWrapper::__maint_vacuum(void)
+{
+    sqlite3_stmt *stmt;
+    int64_t mode = 0;
+    int64_t free_pages = 0;
+
+    for (uint32_t step = 0; step < maint_config.vacuum_max_steps; step++) {
+        ConnLock lock(this, OP_MAINTENANCE, true);
+
+        if (!lock.owns_lock() ||
+                fg_waiting.load(std::memory_order_relaxed) > 0)
+            return -EBUSY;
+        if (step == 0) {
+            if (sqlite3_prepare_v2(db, "PRAGMA auto_vacuum;", -1, &stmt,
+                        NULL) != SQLITE_OK)
+                return -EINVAL;
+            if (sqlite3_step(stmt) == SQLITE_ROW)
+                mode = sqlite3_column_int64(stmt, 0);
+            sqlite3_finalize(stmt);
+            if (mode != 2)
+                return 0;
+        }
+        if (sqlite3_prepare_v2(db, "PRAGMA freelist_count;", -1, &stmt,
+                    NULL) != SQLITE_OK)
+            return -EINVAL;
+        free_pages = 0;
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+            free_pages = sqlite3_column_int64(stmt, 0);
+        sqlite3_finalize(stmt);
+        if (free_pages == 0)
+            return 0;
+        if (__exec("PRAGMA incremental_vacuum(" +
+                    std::to_string(maint_config.vacuum_pages_per_step) +
+                    ");") != 0)
+            return -EAGAIN;
+        lock.unlock();
+        std::this_thread::yield();
+    }
+    return 0;
+}
+
+/*
+ * A deduplicated blob is stored in the user row as the magic below followed
+ * by the native int64 id and tag of its __sw_blob_store row. The tag is
+ * random, drawn when the blob is stored: a user blob shaped like a reference
+ * only passes for one if it also holds the tag of that row, which the user
+ * never sees since references are resolved on read.
+ */
+static const uint8_t dedup_magic[8] = {'S', 'W', 'D', 'E', 'D', 'U', 'P', 0};
+static const uint32_t dedup_ref_len = sizeof(dedup_magic) +
+    2 * sizeof(int64_t);
+
+static bool dedup_parse_ref(const void *data, uint32_t len, int64_t &id,
+        int64_t &tag)
+{
+    auto p = (const uint8_t *)data + sizeof(dedup_magic);
+
+    if (data == nullptr || len != dedup_ref_len ||
+            memcmp(data, dedup_magic, sizeof(dedup_magic)) != 0)
+        return false;
+    memcpy(&id, p, sizeof(id));
+    memcpy(&tag, p + sizeof(id), sizeof(tag));
+    return true;
+}
+
+int SqliteWrapper::enable_blob_dedup(void)
+{
+    TraceScope trace(this, TRACE_ENABLE_BLOB_DEDUP);
+    ConnLock lock(this);
+    int ret = __exec("CREATE TABLE if not exists __sw_blob_store ("
+            "id INTEGER PRIMARY KEY, hash INTEGER NOT NULL, "
+            "refcnt INTEGER NOT NULL, tag INTEGER NOT NULL, "
+            "data BLOB NOT NULL);"
+            "CREATE INDEX if not exists __sw_blob_store_hash "
+            "ON __sw_blob_store (hash);");
+    if (ret == 0)
+        blob_dedup = true;
+    return trace.done(ret, {});
+}
+
+/*
+ * Store every blob (or find its existing copy) and build the map of
+ * references to bind in place of the blobs. ref_bufs backs the memory of the
+ * references, ids receives the store id for each blob. Stored blobs start
+ * with no reference, the caller accounts for them.
+ */
+int SqliteWrapper::__dedup_store_blobs(
+        std::map<const std::string, std::vector<uint8_t>*> &blobs,
+        std::map<const std::string, std::vector<uint8_t>*> &refs,
+        std::vector<std::vector<uint8_t>> &ref_bufs,
+        std::vector<int64_t> &ids)
+{
+    sqlite3_stmt *find_stmt = nullptr;
+    sqlite3_stmt *add_stmt = nullptr;
+    int ret = 0;
+
+    if (sqlite3_prepare_v2(db, "SELECT id, tag, data FROM __sw_blob_store "
+                "WHERE hash = ? AND length(data) = ?;", -1, &find_stmt,
+                NULL) != SQLITE_OK ||
+            sqlite3_prepare_v2(db, "INSERT INTO __sw_blob_store "
+                "(hash, refcnt, tag, data) VALUES (?, 0, ?, ?);", -1,
+                &add_stmt, NULL) != SQLITE_OK)
+    {
+        TB_LOG_ERROR("sqlite3 prepare failed");
+        ret = -EINVAL;
+        goto END;
+    }
+
+    ref_bufs.reserve(ref_bufs.size() + blobs.size());
+    for (auto const &itr : blobs) {
+        auto buf = itr.second;
+        int64_t hash = (int64_t)fnv1a_64(buf->data(), buf->size());
+        int64_t id = 0;
+        int64_t tag = 0;
+        bool found = false;
+
+        sqlite3_reset(find_stmt);
+        sqlite3_bind_int64(find_stmt, 1, hash);
+        sqlite3_bind_int64(find_stmt, 2, (int64_t)buf->size());
+        while (sqlite3_step(find_stmt) == SQLITE_ROW) {
+            //hash collisions are resolved by comparing the content
+            if (buf->empty() || memcmp(sqlite3_column_blob(find_stmt, 2),
+                        buf->data(), buf->size()) == 0) {
+                id = sqlite3_column_int64(find_stmt, 0);
+                tag = sqlite3_column_int64(find_stmt, 1);
+                found = true;
+                break;
+            }
+        }
+        if (!found) {
+            sqlite3_randomness(sizeof(tag), &tag);
+            sqlite3_reset(add_stmt);
+            sqlite3_bind_int64(add_stmt, 1, hash);
+            sqlite3_bind_int64(add_stmt, 2, tag);
+            if (buf->empty())
+                sqlite3_bind_zeroblob(add_stmt, 3, 0);
+            else
+                sqlite3_bind_blob(add_stmt, 3, buf->data(), buf->size(),
+                        SQLITE_STATIC);
+            if (sqlite3_step(add_stmt) != SQLITE_DONE) {
+                TB_LOG_ERROR("sqlite3 step failed");
+                ret = -EAGAIN;
+                goto END;
+            }
+            id = sqlite3_last_insert_rowid(db);
+        }
+
+        ref_bufs.emplace_back(dedup_magic, dedup_magic + sizeof(dedup_magic));
+        ref_bufs.back().resize(dedup_ref_len);
+        memcpy(ref_bufs.back().data() + sizeof(dedup_magic), &id, sizeof(id));
+        memcpy(ref_bufs.back().data() + sizeof(dedup_magic) + sizeof(id),
+                &tag, sizeof(tag));
+        refs[itr.first] = &ref_bufs.back();
+        ids.push_back(id);
+    }
+END:
+    sqlite3_finalize(add_stmt);
+    sqlite3_finalize(find_stmt);
+    return ret;
+}
+
+/*
+ * Add delta to the reference count of blob id, only if its tag matches.
+ * Return 1 if counted, 0 if no such blob, a negative error otherwise.
+ */
+int SqliteWrapper::__dedup_incref(int64_t id, int64_t delta, int64_t tag)
+{
+    sqlite3_stmt *stmt;
+    int ret = 0;
+
+    if (sqlite3_prepare_v2(db, "UPDATE __sw_blob_store SET refcnt = "
+                "refcnt + ? WHERE id = ? AND tag = ?;", -1, &stmt, NULL) !=
+            SQLITE_OK)
+    {
+        TB_LOG_ERROR("sqlite3 prepare failed");
+        return -EINVAL;
+    }
+    sqlite3_bind_int64(stmt, 1, delta);
+    sqlite3_bind_int64(stmt, 2, id);
+    sqlite3_bind_int64(stmt, 3, tag);
+    if (sqlite3_step(stmt) != SQLITE_DONE)
+    {
+        TB_LOG_ERROR("sqlite3 step failed");
+        ret = -EAGAIN;
+    }
+    else
+        ret = sqlite3_changes(db) > 0 ? 1 : 0;
+    sqlite3_finalize(stmt);
+    return ret;
+}
+
+/*
+ * Add delta to the reference count of every blob referenced by the current
+ * row of stmt, starting from column first_col.
+ */
+int SqliteWrapper::__dedup_adjust_row(sqlite3_stmt *stmt, int first_col,
+        int64_t delta, std::vector<int64_t> &touched)
+{
+    int ret = 0;
+
+    for (int col = first_col; col < sqlite3_column_count(stmt); col++) {
+        int64_t id, tag;
+
+        if (sqlite3_column_type(stmt, col) != SQLITE_BLOB)
+            continue;
+        if (!dedup_parse_ref(sqlite3_column_blob(stmt, col),
+                    (uint32_t)sqlite3_column_bytes(stmt, col), id, tag))
+            continue;
+        if ((ret = __dedup_incref(id, delta, tag)) < 0)
+            return ret;
+        //a user blob looking like a reference
+        if (ret == 0)
+            continue;
+        touched.push_back(id);
+    }
+    return 0;
+}
+
+/*
+ * Deduplicated rows must only go away through the wrapper: refuse the
+ * writes SQLite could resolve by deleting or rewriting a row behind its
+ * back, i.e. an upsert updating the conflicting row or a table declaring
+ * ON CONFLICT REPLACE, since their old references would never be released.
+ */
+static std::string sql_words(const std::string &sql)
+{
+    std::string words;
+
+    for (char c : sql) {
+        if (isspace((unsigned char)c)) {
+            if (!words.empty() && words.back() != ' ')
+                words += ' ';
+        } else {
+            words += toupper((unsigned char)c);
+        }
+    }
+    return words;
+}
+
+int SqliteWrapper::__dedup_check_write(const std::string &table_name,
+        const std::string &sql_part)
+{
+    sqlite3_stmt *stmt;
+    bool replace = false;
+
+    if (sql_words(sql_part).find("DO UPDATE") != std::string::npos) {
+        TB_LOG_ERROR("Upsert into %s refused, blob dedup is enabled",
+                table_name.c_str());
+        return -ENOTSUP;
+    }
+    if (sqlite3_prepare_v2(db, "SELECT sql FROM sqlite_master WHERE "
+                "type = 'table' AND name = ?;", -1, &stmt, NULL) != SQLITE_OK)
+    {
+        TB_LOG_ERROR("sqlite3 prepare failed");
+        return -EINVAL;
+    }
+    sqlite3_bind_text(stmt, 1, table_name.c_str(), -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW &&
+            sqlite3_column_text(stmt, 0) != nullptr)
+        replace = sql_words((const char *)sqlite3_column_text(stmt, 0)).find(
+                "CONFLICT REPLACE") != std::string::npos;
+    sqlite3_finalize(stmt);
+    if (replace) {
+        TB_LOG_ERROR("Write to %s refused, blob dedup is enabled and it "
+                "resolves conflicts by REPLACE", table_name.c_str());
+        return -ENOTSUP;
+    }
+    return 0;
+}
+
+/*
+ * Release the references held by the rows matching sql_filter, adding the
+ * blobs to touched. Expected to run before the rows get deleted or
+ * rewritten, the caller then drops the blobs no longer referenced.
+ */
+int SqliteWrapper::__dedup_release_rows(const std::string &table_name,
+        const std::string &sql_filter, std::vector<int64_t> &touched)
+{
+    std::string sql_str = "SELECT * FROM " + table_name + " " +
+        sql_filter + ";";
+    sqlite3_stmt *stmt;
+    int ret = 0;
+    int rc;
+
+    if (sqlite3_prepare_v2(db, sql_str.c_str(), -1, &stmt, NULL) != SQLITE_OK)
+    {
+        TB_LOG_ERROR("sqlite3 prepare failed");
+        return -EINVAL;
+    }
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if ((ret = __dedup_adjust_row(stmt, 0, -1, touched)) != 0)
+            break;
+    }
+    if (ret == 0 && rc != SQLITE_DONE)
+    {
+        TB_LOG_ERROR("sqlite3 step failed");
+        ret = -EAGAIN;
+    }
+    sqlite3_finalize(stmt);
+    return ret;
+}
+
+int SqliteWrapper::__dedup_gc(const std::vector<int64_t> &ids)
+{
+    sqlite3_stmt *stmt;
+    int ret = 0;
+
+    if (ids.empty())
+        return 0;
+    if (sqlite3_prepare_v2(db, "DELETE FROM __sw_blob_store WHERE id = ? "
+                "AND refcnt <= 0;", -1, &stmt, NULL) != SQLITE_OK)
+    {
+        TB_LOG_ERROR("sqlite3 prepare failed");
+        return -EINVAL;
+    }
+    for (auto id : ids) {
+        sqlite3_reset(stmt);
+        sqlite3_bind_int64(stmt, 1, id);
+        if (sqlite3_step(stmt) != SQLITE_DONE)
+        {
+            TB_LOG_ERROR("sqlite3 step failed");
+            ret = -EAGAIN;
+            break;
+        }
+    }
+    sqlite3_finalize(stmt);
+    return ret;
+}
+
+/*
+ * If data/len hold a blob reference, point them to the stored blob instead;
+ * a blob shaped like a reference but matching no stored blob and tag is
+ * user data, left as is. The stored blob stays valid until res_stmt is
+ * finalized by the caller.
+ */
+int SqliteWrapper::__dedup_resolve(sqlite3 *conn, const void *&data,
+        uint32_t &len, sqlite3_stmt *&res_stmt)
+{
+    int64_t id, tag;
+    int rc;
+
+    if (!dedup_parse_ref(data, len, id, tag))
+        return 0;
+    if (sqlite3_prepare_v2(conn, "SELECT data FROM __sw_blob_store "
+                "WHERE id = ? AND tag = ?;", -1, &res_stmt, NULL) != SQLITE_OK)
+    {
+        TB_LOG_ERROR("sqlite3 prepare failed");
+        return -EINVAL;
+    }
+    sqlite3_bind_int64(res_stmt, 1, id);
+    sqlite3_bind_int64(res_stmt, 2, tag);
+    if ((rc = sqlite3_step(res_stmt)) == SQLITE_DONE)
+        return 0;
+    if (rc != SQLITE_ROW)
+    {
+        TB_LOG_ERROR("sqlite3 step failed: %s", sqlite3_errmsg(conn));
+        return -EAGAIN;
+    }
+    data = sqlite3_column_blob(res_stmt, 0);
+    len = (uint32_t)sqlite3_column_bytes(res_stmt, 0);
+    return 0;
+}
+/*
+ * Encode a key value so keys SQL compares equal encode equal: an integral
+ * REAL is encoded as the INTEGER it equals (1.0 as 1)
+ */
+static std::string wb_key(const SqliteWrapper::Value &key)
+{
+    std::string encoded;
+    int type = key.type;
+    int64_t i = key.i;
+
+    if (type == SQLITE_FLOAT && key.d >= -9223372036854775808.0 &&
+            key.d < 9223372036854775808.0 && key.d == (double)(int64_t)key.d) {
+        type = SQLITE_INTEGER;
+        i = (int64_t)key.d;
+    }
+    encoded.assign(1, (char)type);
+    switch (type) {
+        case SQLITE_INTEGER:
+            encoded.append((const char *)&i, sizeof(i));
+            break;
+        case SQLITE_FLOAT:
+            encoded.append((const char *)&key.d, sizeof(key.d));
+            break;
+        default:
+            encoded.append(key.bytes.begin(), key.bytes.end());
+            break;
+    }
+    return encoded;
+}
+
+int SqliteWrapper::enable_write_back(const std::string &table_name,
+        const std::string &key_column, const WriteBackConfig &config)
+{
+    std::unique_lock<std::mutex> lock(wb_mutex);
+
+    if (lock_policy == LOCK_NONE)
+        return -EINVAL;
+    if (key_column.empty() || config.max_keys == 0 ||
+            config.max_delay_ms == 0)
+        return -EINVAL;
+    if (wb_tables.count(table_name) != 0)
+        return -EBUSY;
+    wb_tables[table_name].key_column = key_column;
+    wb_tables[table_name].config = config;
+    write_back = true;
+    if (wb_thread.joinable())
+        return 0;
+
+    wb_thread = std::thread([this]() {
+        std::unique_lock<std::mutex> lock(wb_mutex);
+
+        while (!wb_stop) {
+            std::vector<std::string> due;
+            int64_t now = steady_ms();
+            int64_t next = -1;
+            uint32_t backoff_ms = 0;
+
+            for (auto const &itr : wb_tables) {
+                auto const &table = itr.second;
+                int64_t deadline = table.oldest_ms + table.config.max_delay_ms;
+
+                if (table.dirty.empty())
+                    continue;
+                if (table.dirty.size() >= table.config.max_keys ||
+                        deadline <= now)
+                    due.push_back(itr.first);
+                else if (next < 0 || deadline < next)
+                    next = deadline;
+            }
+            if (!due.empty()) {
+                std::vector<std::string> failed;
+
+                lock.unlock();
+                for (auto const &name : due) {
+                    if (__wb_flush(name) != 0)
+                        failed.push_back(name);
+                }
+                lock.lock();
+                for (auto const &name : failed)
+                    backoff_ms = std::max(backoff_ms,
+                            wb_tables[name].config.max_delay_ms);
+                //a failed flush keeps its keys, retry them later
+                if (backoff_ms > 0)
+                    wb_cv.wait_for(lock, std::chrono::milliseconds(backoff_ms),
+                            [this]() { return wb_stop; });
+                continue;
+            }
+            if (next < 0)
+                wb_cv.wait(lock);
+            else
+                wb_cv.wait_for(lock, std::chrono::milliseconds(next - now));
+        }
+    });
+    return 0;
+}
+
+int SqliteWrapper::enable_write_back(const std::string &table_name,
+        const std::string &key_column)
+{
+    return enable_write_back(table_name, key_column, WriteBackConfig());
+}
+
+int SqliteWrapper::put_entry(const std::string &table_name, const Value &key,
+        const std::map<std::string, Value> &columns)
+{
+    std::unique_lock<std::mutex> lock(wb_mutex);
+    auto itr = wb_tables.find(table_name);
+
+    if (itr == wb_tables.end() || key.type == SQLITE_NULL || columns.empty())
+        return -EINVAL;
+    auto &table = itr->second;
+    if (columns.count(table.key_column) != 0)
+        return -EINVAL;
+
+    bool was_empty = table.dirty.empty();
+    auto &entry = table.dirty[wb_key(key)];
+    entry.key = key;
+    for (auto const &col : columns)
+        entry.columns[col.first] = col.second;
+    if (was_empty)
+        table.oldest_ms = steady_ms();
+    //arm the flush timer, or flush now once max_keys is reached
+    if (was_empty || table.dirty.size() == table.config.max_keys)
+        wb_cv.notify_one();
+    return 0;
+}
+
+int SqliteWrapper::get_key_entry(std::vector<Value> &out,
+        const std::string &table_name, const Value &key,
+        const std::vector<std::string> &columns)
+{
+    std::string encoded = wb_key(key);
+    std::string key_column;
+    std::string sql_str;
+    sqlite3_stmt *stmt;
+    bool found = false;
+    int ret = 0;
+    int rc;
+
+    out.assign(columns.size(), Value());
+    {
+        std::unique_lock<std::mutex> lock(wb_mutex);
+        auto itr = wb_tables.find(table_name);
+        size_t hits = 0;
+
+        if (itr == wb_tables.end())
+            return -EINVAL;
+        key_column = itr->second.key_column;
+        auto entry = itr->second.dirty.find(encoded);
+        if (entry != itr->second.dirty.end()) {
+            for (size_t i = 0; i < columns.size(); i++) {
+                auto col = entry->second.columns.find(columns[i]);
+
+                if (columns[i] == key_column) {
+                    out[i] = key;
+                    hits++;
+                } else if (col != entry->second.columns.end()) {
+                    out[i] = col->second;
+                    hits++;
+                }
+            }
+            if (hits == columns.size())
+                return 0;
+        }
+    }
+
+    Deadline deadline(this);
+    ConnLock lock(this, OP_GET_ENTRY);
+    for (auto const &col : columns)
+        sql_str += (sql_str.empty() ? "" : ", ") + col;
+    if (sql_str.empty())
+        sql_str = "1";
+    sql_str = "SELECT " + sql_str + " FROM " + table_name + " WHERE " +
+        key_column + " = ?;";
+    TB_LOG_DEBUG("sqlite3 get: %s", sql_str.c_str());
+    if (sqlite3_prepare_v2(db, sql_str.c_str(), -1, &stmt, NULL) != SQLITE_OK)
+    {
+        TB_LOG_ERROR("sqlite3 prepare failed");
+        return -EINVAL;
+    }
+    __bind_value(stmt, 1, key);
+    if ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        found = true;
+        for (size_t i = 0; i < columns.size(); i++) {
+            if ((ret = __load_column(stmt, i, out[i])) != 0)
+                goto END;
+        }
+    } else if (rc != SQLITE_DONE) {
+        TB_LOG_ERROR("sqlite3 step failed");
+        ret = -EAGAIN;
+        goto END;
+    }
+
+    //updates buffered meanwhile are newer than the stored row
+    {
+        std::unique_lock<std::mutex> wb_lock(wb_mutex);
+        auto const &dirty = wb_tables[table_name].dirty;
+        auto entry = dirty.find(encoded);
+
+        if (entry != dirty.end()) {
+            found = true;
+            for (size_t i = 0; i < columns.size(); i++) {
+                auto col = entry->second.columns.find(columns[i]);
+
+                if (col != entry->second.columns.end())
+                    out[i] = col->second;
+            }
+        }
+    }
+    if (!found)
+        ret = -ENOENT;
+END:
+    sqlite3_finalize(stmt);
+    return deadline.result(ret);
+}
+
+int SqliteWrapper::flush_write_back(void)
+{
+    std::vector<std::string> names;
+    int ret = 0;
+    int err;
+
+    {
+        std::unique_lock<std::mutex> lock(wb_mutex);
+
+        for (auto const &itr : wb_tables)
+            names.push_back(itr.first);
+    }
+    for (auto const &name : names) {
+        if ((err = __wb_flush(name)) != 0 && ret == 0)
+            ret = err;
+    }
+    return ret;
+}
+
+/*
+ * Flush the buffered keys of table_name, if any. The keys are taken out of
+ * the buffer under the connection lock, so readers missing them in memory
+ * wait for the flush and find them stored; on failure they are put back,
+ * behind the updates buffered meanwhile.
+ */
+int SqliteWrapper::__wb_flush(const std::string &table_name)
+{
+    std::map<std::string, WbEntry> entries;
+    std::string key_column;
+    int ret;
+
+    if (!write_back.load(std::memory_order_relaxed))
+        return 0;
+    {
+        std::unique_lock<std::mutex> lock(wb_mutex);
+        auto itr = wb_tables.find(table_name);
+
+        if (itr == wb_tables.end() || itr->second.dirty.empty())
+            return 0;
+    }
+
+    ConnLock lock(this, OP_WRITE_BACK);
+    {
+        std::unique_lock<std::mutex> wb_lock(wb_mutex);
+        auto &table = wb_tables[table_name];
+
+        entries.swap(table.dirty);
+        key_column = table.key_column;
+    }
+    if (entries.empty())
+        return 0;
+    if ((ret = __wb_write(table_name, key_column, entries)) == 0)
+        return 0;
+
+    TB_LOG_WARNING("Flush of %zu buffered keys of %s failed: %d",
+            entries.size(), table_name.c_str(), ret);
+    std::unique_lock<std::mutex> wb_lock(wb_mutex);
+    auto &table = wb_tables[table_name];
+    if (table.dirty.empty())
+        table.oldest_ms = steady_ms();
+    for (auto &itr : entries) {
+        auto &entry = table.dirty[itr.first];
+
+        entry.key = itr.second.key;
+        //insert() keeps the newer values buffered during the flush
+        entry.columns.insert(itr.second.columns.begin(),
+                itr.second.columns.end());
+    }
+    return ret;
+}
+
+/*
+ * Upsert the entries in a single transaction. One statement is prepared per
+ * distinct set of columns.
+ */
+int SqliteWrapper::__wb_write(const std::string &table_name,
+        const std::string &key_column,
+        const std::map<std::string, WbEntry> &entries)
+{
+    std::map<std::string, sqlite3_stmt *> stmts;
+    int ret;
+
+    if ((ret = __exec("BEGIN IMMEDIATE;")) != 0)
+        return ret;
+    for (auto const &itr : entries) {
+        auto const &entry = itr.second;
+        std::string names = key_column;
+        std::string params = "?";
+        std::string sets;
+        sqlite3_stmt *stmt;
+        int idx = 1;
+
+        for (auto const &col : entry.columns) {
+            names += ", " + col.first;
+            params += ", ?";
+            sets += (sets.empty() ? "" : ", ") + col.first + " = excluded." +
+                col.first;
+        }
+        std::string sql_str = "INSERT INTO " + table_name + " (" + names +
+            ") VALUES (" + params + ") ON CONFLICT(" + key_column +
+            ") DO UPDATE SET " + sets + ";";
+
+        auto cached = stmts.find(sql_str);
+        if (cached != stmts.end()) {
+            stmt = cached->second;
+            sqlite3_reset(stmt);
+        } else {
+            TB_LOG_DEBUG("sqlite3 prepare: %s", sql_str.c_str());
+            if (sqlite3_prepare_v2(db, sql_str.c_str(), -1, &stmt, NULL) !=
+                    SQLITE_OK)
+            {
+                TB_LOG_ERROR("sqlite3 prepare failed: %s",
+                        sqlite3_errmsg(db));
+                ret = -EINVAL;
+                goto END;
+            }
+            stmts[sql_str] = stmt;
+        }
+        __bind_value(stmt, idx++, entry.key);
+        for (auto const &col : entry.columns)
+            __bind_value(stmt, idx++, col.second);
+        if (sqlite3_step(stmt) != SQLITE_DONE)
+        {
+            TB_LOG_ERROR("sqlite3 step failed: %s", sqlite3_errmsg(db));
+            ret = -EAGAIN;
+            goto END;
+        }
+    }
+END:
+    for (auto const &itr : stmts)
+        sqlite3_finalize(itr.second);
+    if (ret == 0)
+        ret = __exec("COMMIT;");
+    if (ret != 0)
+        __exec("ROLLBACK;");
+    return ret;
+}
+int SqliteWrapper::__parallel_scan(const std::string &table_name,
+        const std::string &sql_values, const std::string &sql_filter,
+        const std::string &key_column, uint32_t partitions,
+        const std::function<void(uint32_t,
+            const std::vector<Value> &)> &on_row)
+{
+    std::shared_lock<std::shared_timed_mutex> fn_lock(functions_mutex);
+    std::vector<sqlite3 *> conns(partitions, nullptr);
+    std::vector<std::thread> threads;
+    std::vector<int> results(partitions, 0);
+    std::vector<Value> bounds;
+    std::atomic<bool> failed{false};
+    std::string select = "SELECT " + sql_values + " FROM " + table_name +
+        " WHERE " + (sql_filter.empty() ? "1" : "(" + sql_filter + ")");
+    std::string path;
+    int ret = 0;
+
+    if (partitions == 0)
+        return -EINVAL;
+    __wb_flush(table_name);
+
+    /*
+     * No commit can happen while the write lock is held: every connection
+     * starting its read transaction meanwhile gets the same snapshot.
+     */
+    {
+        ConnLock lock(this, OP_PARALLEL_SCAN);
+        const char *filename = sqlite3_db_filename(db, "main");
+
+        if (filename == nullptr || filename[0] == '\0')
+            return -EINVAL;
+        path = filename;
+        if ((ret = __exec("BEGIN IMMEDIATE;")) != 0)
+            return ret;
+        for (auto &conn : conns) {
+            if ((ret = __scan_open(path, conn)) != 0)
+                break;
+        }
+        __exec("ROLLBACK;");
+    }
+    if (ret != 0)
+        goto END;
+    if ((ret = __scan_bounds(conns[0], table_name, key_column, partitions,
+                    bounds)) != 0) {
+        if (ret == -ENOENT)
+            ret = 0;
+        goto END;
+    }
+
+    //partition i covers [bounds[i - 1], bounds[i]), the ends are open
+    for (uint32_t i = 0; i < partitions; i++) {
+        const Value *lower = i == 0 ? nullptr : &bounds[i - 1];
+        const Value *upper = i == partitions - 1 ? nullptr : &bounds[i];
+        std::string sql_str = select +
+            (lower != nullptr ? " AND " + key_column + " >= ?" : "") +
+            (upper != nullptr ? " AND " + key_column + " < ?" : "") + ";";
+
+        threads.emplace_back([this, &conns, &results, &on_row, &failed,
+                sql_str, lower, upper, i]() {
+            OpScope op_scope(this, OP_PARALLEL_SCAN);
+
+            results[i] = __scan_partition(conns[i], sql_str, lower, upper, i,
+                    on_row, failed);
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+    for (auto result : results) {
+        if (result != 0) {
+            ret = result;
+            break;
+        }
+    }
+END:
+    for (auto conn : conns) {
+        if (conn == nullptr)
+            continue;
+        sqlite3_exec(conn, "ROLLBACK;", nullptr, nullptr, nullptr);
+        sqlite3_close(conn);
+    }
+    return ret;
+}
+
+/*
+ * Open a read only connection to path, with the registered functions, and
+ * start its read transaction
+ */
+int SqliteWrapper::__scan_open(const std::string &path, sqlite3 *&conn)
+{
+    int flags = SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX;
+
+    if (sqlite3_open_v2(path.c_str(), &conn, flags,
+                io_vfs != nullptr ? io_vfs->name() : nullptr) != SQLITE_OK)
+    {
+        TB_LOG_ERROR("Can't open scan connection: %s", sqlite3_errmsg(conn));
+        return -EAGAIN;
+    }
+    for (auto const &itr : functions) {
+        auto const &fn = itr.second;
+
+        //the application data stays owned by the wrapper connection
+        if (sqlite3_create_function_v2(conn, itr.first.first.c_str(),
+                    fn.nargs, fn.flags, fn.app, fn.func, fn.step, fn.final,
+                    nullptr) != SQLITE_OK)
+        {
+            TB_LOG_ERROR("register function %s failed: %s",
+                    itr.first.first.c_str(), sqlite3_errmsg(conn));
+            return -EINVAL;
+        }
+    }
+    if (sqlite3_exec(conn, "BEGIN; SELECT 1 FROM sqlite_master LIMIT 1;",
+                nullptr, nullptr, nullptr) != SQLITE_OK)
+    {
+        TB_LOG_ERROR("Can't start scan snapshot: %s", sqlite3_errmsg(conn));
+        return -EAGAIN;
+    }
+    return 0;
+}
+
+/*
+ * Split the key range in partitions, giving the partitions - 1 inner
+ * bounds. Return -ENOENT if the table is empty.
+ */
+int SqliteWrapper::__scan_bounds(sqlite3 *conn, const std::string &table_name,
+        const std::string &key_column, uint32_t partitions,
+        std::vector<Value> &bounds)
+{
+    std::string sql_str = "SELECT min(" + key_column + "), max(" +
+        key_column + "), count(*) FROM " + table_name + ";";
+    sqlite3_stmt *stmt;
+    Value lo;
+    Value hi;
+    int64_t count;
+    int ret = 0;
+
+    TB_LOG_DEBUG("sqlite3 prepare: %s", sql_str.c_str());
+    if (sqlite3_prepare_v2(conn, sql_str.c_str(), -1, &stmt, NULL) !=
+            SQLITE_OK)
+    {
+        TB_LOG_ERROR("sqlite3 prepare failed: %s", sqlite3_errmsg(conn));
+        return -EINVAL;
+    }
+    if (sqlite3_step(stmt) != SQLITE_ROW)
+    {
+        TB_LOG_ERROR("sqlite3 step failed");
+        sqlite3_finalize(stmt);
+        return -EAGAIN;
+    }
+    __load_column(stmt, 0, lo);
+    __load_column(stmt, 1, hi);
+    count = sqlite3_column_int64(stmt, 2);
+    sqlite3_finalize(stmt);
+    if (count == 0)
+        return -ENOENT;
+
+    bounds.resize(partitions - 1);
+    if (lo.type == SQLITE_INTEGER && hi.type == SQLITE_INTEGER) {
+        uint64_t span = (uint64_t)hi.i - (uint64_t)lo.i;
+
+        for (uint32_t i = 1; i < partitions; i++)
+            bounds[i - 1] = Value((int64_t)((uint64_t)lo.i +
+                        span / partitions * i + span % partitions * i /
+                        partitions));
+        return 0;
+    }
+
+    sql_str = "SELECT " + key_column + " FROM " + table_name + " ORDER BY " +
+        key_column + " LIMIT 1 OFFSET ?;";
+    if (sqlite3_prepare_v2(conn, sql_str.c_str(), -1, &stmt, NULL) !=
+            SQLITE_OK)
+    {
+        TB_LOG_ERROR("sqlite3 prepare failed: %s", sqlite3_errmsg(conn));
+        return -EINVAL;
+    }
+    for (uint32_t i = 1; i < partitions; i++) {
+        sqlite3_reset(stmt);
+        sqlite3_bind_int64(stmt, 1, count * i / partitions);
+        if (sqlite3_step(stmt) != SQLITE_ROW)
+        {
+            TB_LOG_ERROR("sqlite3 step failed");
+            ret = -EAGAIN;
+            break;
+        }
+        if ((ret = __load_column(stmt, 0, bounds[i - 1])) != 0)
+            break;
+    }
+    sqlite3_finalize(stmt);
+    return ret;
+}
+
+int SqliteWrapper::__scan_partition(sqlite3 *conn, const std::string &sql_str,
+        const Value *lower, const Value *upper, uint32_t part,
+        const std::function<void(uint32_t,
+            const std::vector<Value> &)> &on_row,
+        std::atomic<bool> &failed)
+{
+    std::vector<Value> row;
+    sqlite3_stmt *stmt;
+    int idx = 1;
+    int ret = 0;
+    int rc = SQLITE_DONE;
+
+    TB_LOG_DEBUG("sqlite3 scan: %s", sql_str.c_str());
+    if (sqlite3_prepare_v2(conn, sql_str.c_str(), -1, &stmt, NULL) !=
+            SQLITE_OK)
+    {
+        TB_LOG_ERROR("sqlite3 prepare failed: %s", sqlite3_errmsg(conn));
+        failed = true;
+        return -EINVAL;
+    }
+    if (lower != nullptr)
+        __bind_value(stmt, idx++, *lower);
+    if (upper != nullptr)
+        __bind_value(stmt, idx++, *upper);
+
+    //a failed partition stops the others
+    while (!failed.load(std::memory_order_relaxed) &&
+            (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        int cols = sqlite3_column_count(stmt);
+
+        row.assign(cols, Value());
+        for (int i = 0; i < cols; i++) {
+            if ((ret = __load_column(stmt, i, row[i])) != 0)
+                goto END;
+        }
+        on_row(part, row);
+    }
+    if (!failed && rc != SQLITE_DONE)
+    {
+        TB_LOG_ERROR("sqlite3 step failed: %s", sqlite3_errmsg(conn));
+        ret = -EAGAIN;
+    }
+END:
+    if (ret != 0)
+        failed = true;
+    sqlite3_finalize(stmt);
+    return ret;
+}
 /*
 int SqliteWrapper::create_table_byjson(const std::string &para)
 {
@@ -0,0 +1,178 @@
+#include <errno.h>
+#include <string.h>
+#include "log.h"
+#include "sqlite_wrapper_trace.h"
+
+static const char trace_magic[8] = {'S', 'W', 'T', 'R', 'A', 'C', 'E', '1'};
+
+TraceWriter::~TraceWriter()
+{
+    close();
+}
+
+int TraceWriter::open(const std::string &path)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    if (fp != nullptr)
+        return -EBUSY;
+    if ((fp = fopen(path.c_str(), "wb")) == nullptr)
+    {
+        TB_LOG_ERROR("Can't open trace file: %s", path.c_str());
+        return -errno;
+    }
+    setvbuf(fp, nullptr, _IOFBF, 1 << 16);
+    if (fwrite(trace_magic, sizeof(trace_magic), 1, fp) != 1)
+    {
+        fclose(fp);
+        fp = nullptr;
+        return -EIO;
+    }
+    start = std::chrono::steady_clock::now();
+    threads.clear();
+    return 0;
+}
+
+void TraceWriter::close(void)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    if (fp != nullptr) {
+        fclose(fp);
+        fp = nullptr;
+    }
+}
+
+uint64_t TraceWriter::now_ns(void)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+}
+
+template<typename T>
+static void put(std::vector<uint8_t> &buf, T value)
+{
+    buf.insert(buf.end(), (const uint8_t *)&value,
+            (const uint8_t *)&value + sizeof(value));
+}
+
+static void put_str(std::vector<uint8_t> &buf, const std::string &str)
+{
+    put<uint32_t>(buf, str.size());
+    buf.insert(buf.end(), str.begin(), str.end());
+}
+
+/*
+ * write: fill in the thread of the record and append it to the trace
+ */
+int TraceWriter::write(TraceRecord &record)
+{
+    std::vector<uint8_t> buf;
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    if (fp == nullptr)
+        return -EINVAL;
+    auto itr = threads.find(std::this_thread::get_id());
+    if (itr == threads.end())
+        itr = threads.emplace(std::this_thread::get_id(),
+                threads.size()).first;
+    record.thread = itr->second;
+
+    put<uint8_t>(buf, record.method);
+    put<uint32_t>(buf, record.thread);
+    put<uint32_t>(buf, record.aux);
+    put<int32_t>(buf, record.result);
+    put<uint64_t>(buf, record.ts_ns);
+    put<uint64_t>(buf, record.duration_ns);
+    put<uint8_t>(buf, record.args.size());
+    for (auto const &arg : record.args)
+        put_str(buf, arg);
+    put<uint16_t>(buf, record.blobs.size());
+    for (auto const &blob : record.blobs) {
+        put_str(buf, blob.name);
+        put<uint32_t>(buf, blob.size);
+        put<uint64_t>(buf, blob.hash);
+    }
+    if (fwrite(buf.data(), buf.size(), 1, fp) != 1)
+        return -EIO;
+    return 0;
+}
+
+TraceReader::~TraceReader()
+{
+    if (fp != nullptr)
+        fclose(fp);
+}
+
+int TraceReader::open(const std::string &path)
+{
+    char magic[sizeof(trace_magic)];
+
+    if (fp != nullptr)
+        return -EBUSY;
+    if ((fp = fopen(path.c_str(), "rb")) == nullptr)
+        return -errno;
+    if (fseek(fp, 0, SEEK_END) == 0)
+        size = ftell(fp);
+    rewind(fp);
+    if (fread(magic, sizeof(magic), 1, fp) != 1 ||
+            memcmp(magic, trace_magic, sizeof(magic)) != 0)
+    {
+        TB_LOG_ERROR("Not a wrapper trace: %s", path.c_str());
+        fclose(fp);
+        fp = nullptr;
+        return -EINVAL;
+    }
+    return 0;
+}
+
+template<typename T>
+static bool get(FILE *fp, T &value)
+{
+    return fread(&value, sizeof(value), 1, fp) == 1;
+}
+
+/*
+ * The length is checked against the bytes left in the file before any
+ * allocation, a corrupted length fails the record
+ */
+static bool get_str(FILE *fp, long size, std::string &str)
+{
+    uint32_t len;
+
+    if (!get(fp, len) || len > size - ftell(fp))
+        return false;
+    str.resize(len);
+    return len == 0 || fread(&str[0], len, 1, fp) == 1;
+}
+
+int TraceReader::read(TraceRecord &record)
+{
+    uint8_t nargs;
+    uint16_t nblobs;
+
+    if (fp == nullptr)
+        return -EINVAL;
+    if (!get(fp, record.method))
+        return feof(fp) ? -ENOENT : -EINVAL;
+    if (!get(fp, record.thread) || !get(fp, record.aux) ||
+            !get(fp, record.result) || !get(fp, record.ts_ns) ||
+            !get(fp, record.duration_ns) || !get(fp, nargs))
+        return -EINVAL;
+    record.args.resize(nargs);
+    for (auto &arg : record.args) {
+        if (!get_str(fp, size, arg))
+            return -EINVAL;
+    }
+    if (!get(fp, nblobs))
+        return -EINVAL;
+    record.blobs.resize(nblobs);
+    for (auto &blob : record.blobs) {
+        if (!get_str(fp, size, blob.name) || !get(fp, blob.size) ||
+                !get(fp, blob.hash))
+            return -EINVAL;
+    }
+    if (record.method == 0 || record.method >= TRACE_METHOD_MAX)
+        return -EINVAL;
+    return 0;
+}
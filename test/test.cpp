@@ -1,4 +1,6 @@
 #include "sqlite_wrapper.h"
+#include <dirent.h>
+#include <sys/stat.h>
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
 
@@ -487,6 +489,1348 @@ TEST_F(TestSqliteWrapper, test_get_blob_dynamic_alloc)
         ASSERT_EQ(0, memcmp(src_data.data(), out_buf.data(), src_data.size()));
     }
 }
+TEST_F(TestSqliteWrapper, test_blob_dedup)
+{
+    ASSERT_TRUE(sw != nullptr);
+    ASSERT_TRUE(sw->is_ok());
+
+    std::string table_name = "dummy_1";
+    std::vector<uint8_t> src_data = {65, 66, 67, 68, 69, 70};
+    std::vector<uint8_t> new_data = {31, 32, 33, 34};
+    auto store_stat = [this](int64_t &count, int64_t &refs) {
+        std::vector<SqliteWrapper::GetItem> out = {
+            SqliteWrapper::GetItem(&count, sizeof(count)),
+            SqliteWrapper::GetItem(&refs, sizeof(refs))
+        };
+        count = refs = 0;
+        return sw->get_entry(out, "__sw_blob_store",
+                "count(*), ifnull(sum(refcnt), 0)", "");
+    };
+    int64_t count, refs;
+
+    ASSERT_EQ(0, sw->enable_blob_dedup());
+    //create table
+    {
+        std::string sql_str = "num1 INT, data1 BLOB";
+
+        ASSERT_EQ(0,sw->create_table(table_name, sql_str));
+    }
+    //insert the same blob twice, expect a single stored copy
+    for (int i = 1; i <= 2; i++) {
+        std::string sql_str = "(num1, data1) VALUES (" + std::to_string(i) +
+            ", @_p1)";
+        std::map<const std::string, std::vector<uint8_t>*> blobs = {
+            std::make_pair("@_p1", &src_data)
+        };
+        ASSERT_EQ(0,sw->insert_entry(table_name, sql_str, &blobs));
+    }
+    store_stat(count, refs);
+    ASSERT_EQ(1, count);
+    ASSERT_EQ(2, refs);
+    //get resolves the reference
+    {
+        std::vector<uint8_t> out_buf;
+        auto copy = [&out_buf](const void* src, uint32_t size) {
+            out_buf.assign((const uint8_t *)src, (const uint8_t *)src + size);
+            return 0;
+        };
+        std::vector<SqliteWrapper::GetItem> out = {
+            SqliteWrapper::GetItem(nullptr, 0, copy)
+        };
+
+        ASSERT_EQ(0, sw->get_entry(out, table_name, "data1", "WHERE num1 = 2"));
+        ASSERT_EQ(src_data, out_buf);
+    }
+    //update one row to a new blob
+    {
+        std::map<const std::string, std::vector<uint8_t>*> blobs = {
+            std::make_pair("@_p1", &new_data)
+        };
+        ASSERT_EQ(0,sw->update_entry(table_name, "data1 = @_p1",
+                    "WHERE num1 = 1", &blobs));
+    }
+    store_stat(count, refs);
+    ASSERT_EQ(2, count);
+    ASSERT_EQ(2, refs);
+    //user blobs shaped like a reference to stored blob 1 stay user data
+    for (auto hex : {"5357444544555000" "0100000000000000",
+            "5357444544555000" "0100000000000000" "0000000000000000"}) {
+        std::string lit = hex;
+        std::string sql_str = "(num1, data1) VALUES (3, X'" + lit + "')";
+        std::vector<uint8_t> out_buf;
+        auto copy = [&out_buf](const void* src, uint32_t size) {
+            out_buf.assign((const uint8_t *)src, (const uint8_t *)src + size);
+            return 0;
+        };
+        std::vector<SqliteWrapper::GetItem> out = {
+            SqliteWrapper::GetItem(nullptr, 0, copy)
+        };
+
+        ASSERT_EQ(0,sw->insert_entry(table_name, sql_str));
+        ASSERT_EQ(0, sw->get_entry(out, table_name, "data1", "WHERE num1 = 3"));
+        ASSERT_EQ(lit.size() / 2, out_buf.size());
+        ASSERT_EQ('S', out_buf[0]);
+        ASSERT_EQ(1, out_buf[8]);
+        ASSERT_EQ(0, sw->delete_entry(table_name, "WHERE num1 = 3"));
+        store_stat(count, refs);
+        ASSERT_EQ(2, count);
+        ASSERT_EQ(2, refs);
+    }
+    //deleting the last reference drops the stored copy
+    ASSERT_EQ(0, sw->delete_entry(table_name, "WHERE num1 = 2"));
+    store_stat(count, refs);
+    ASSERT_EQ(1, count);
+    ASSERT_EQ(1, refs);
+    //an update moving the row keeps its reference counted
+    {
+        std::map<const std::string, std::vector<uint8_t>*> blobs = {
+            std::make_pair("@_p1", &src_data)
+        };
+        ASSERT_EQ(0,sw->update_entry(table_name,
+                    "data1 = @_p1, rowid = rowid + 100", "WHERE num1 = 1",
+                    &blobs));
+    }
+    store_stat(count, refs);
+    ASSERT_EQ(1, count);
+    ASSERT_EQ(1, refs);
+    ASSERT_EQ(0, sw->delete_all_entry(table_name));
+    store_stat(count, refs);
+    ASSERT_EQ(0, count);
+    //conflicts resolved by deleting or rewriting rows are refused
+    {
+        std::map<const std::string, std::vector<uint8_t>*> blobs = {
+            std::make_pair("@_p1", &src_data)
+        };
+
+        ASSERT_EQ(0,sw->create_table("dummy_2",
+                    "num1 INT UNIQUE ON CONFLICT REPLACE, data1 BLOB"));
+        ASSERT_EQ(-ENOTSUP, sw->insert_entry("dummy_2",
+                    "(num1, data1) VALUES (1, @_p1)", &blobs));
+        ASSERT_EQ(0,sw->create_table("dummy_3",
+                    "num1 INT UNIQUE, data1 BLOB"));
+        ASSERT_EQ(0, sw->insert_entry("dummy_3",
+                    "(num1, data1) VALUES (1, @_p1)", &blobs));
+        ASSERT_EQ(-ENOTSUP, sw->insert_entry("dummy_3",
+                    "(num1, data1) VALUES (1, @_p1) ON CONFLICT(num1) "
+                    "DO UPDATE SET data1 = excluded.data1", &blobs));
+        ASSERT_EQ(0, sw->delete_all_entry("dummy_3"));
+    }
+    store_stat(count, refs);
+    ASSERT_EQ(0, count);
+}
+TEST_F(TestSqliteWrapper, test_cursor_keyset)
+{
+    ASSERT_TRUE(sw != nullptr);
+    ASSERT_TRUE(sw->is_ok());
+
+    std::string table_name = "dummy_1";
+
+    //create table
+    {
+        std::string sql_str = "num1 INTEGER PRIMARY KEY, str1 TEXT";
+
+        ASSERT_EQ(0,sw->create_table(table_name, sql_str));
+    }
+    for (int i = 1; i <= 10; i++) {
+        std::string sql_str = "(num1, str1) VALUES (" + std::to_string(i) +
+            ", \"str" + std::to_string(i) + "\")";
+        ASSERT_EQ(0,sw->insert_entry(table_name, sql_str));
+    }
+    //page size smaller than the result, with a filter
+    {
+        SqliteWrapper::Cursor cursor(*sw, table_name, "num1, str1",
+                "num1 > 2", "num1", 3);
+        int out_num;
+        std::string out_str;
+        auto copy = [&out_str](const void* src, uint32_t size) {
+            out_str.assign((const char *)src, size);
+            return 0;
+        };
+        std::vector<SqliteWrapper::GetItem> out = {
+            SqliteWrapper::GetItem(&out_num, 0),
+            SqliteWrapper::GetItem(nullptr, 0, copy)
+        };
+        int expect = 3;
+
+        while (cursor.next(out) == 0) {
+            ASSERT_EQ(expect, out_num);
+            ASSERT_EQ("str" + std::to_string(expect), out_str);
+            //writers are not blocked between pages
+            if (expect == 4) {
+                ASSERT_EQ(0, sw->insert_entry(table_name,
+                            "(num1, str1) VALUES (11, \"str11\")"));
+            }
+            expect++;
+        }
+        ASSERT_EQ(12, expect);
+        ASSERT_EQ(-ENOENT, cursor.next(out));
+    }
+}
+TEST_F(TestSqliteWrapper, test_change_capture)
+{
+    ASSERT_TRUE(sw != nullptr);
+    ASSERT_TRUE(sw->is_ok());
+
+    std::string table_name = "dummy_1";
+    std::unique_ptr<ChangeRing::Reader> reader;
+    std::vector<ChangeEvent> events;
+
+    ASSERT_EQ(-EINVAL, sw->subscribe_changes(reader));
+    ASSERT_EQ(0, sw->enable_change_capture(4));
+    ASSERT_EQ(0, sw->subscribe_changes(reader));
+    //create table
+    {
+        std::string sql_str = "num1 INT, str1 TEXT";
+
+        ASSERT_EQ(0,sw->create_table(table_name, sql_str));
+    }
+    ASSERT_EQ(0, sw->insert_entry(table_name, "(num1) VALUES (1)"));
+    ASSERT_EQ(0, sw->update_entry(table_name, "str1 = \"a\"", "WHERE num1 = 1"));
+    ASSERT_EQ(0, sw->delete_entry(table_name, "WHERE num1 = 1"));
+    //a failing statement publishes nothing
+    ASSERT_NE(0, sw->insert_entry(table_name, "(num1, nope) VALUES (1, 1)"));
+
+    ASSERT_EQ(3u, reader->poll(events));
+    ASSERT_EQ(SQLITE_INSERT, events[0].op);
+    ASSERT_EQ(SQLITE_UPDATE, events[1].op);
+    ASSERT_EQ(SQLITE_DELETE, events[2].op);
+    ASSERT_EQ(events[0].rowid, events[2].rowid);
+    ASSERT_STREQ("dummy_1", events[0].table);
+    ASSERT_EQ(0u, reader->lost());
+
+    //overflow of a slow reader is reported, not blocking
+    for (int i = 0; i < 10; i++)
+        ASSERT_EQ(0, sw->insert_entry(table_name, "(num1) VALUES (2)"));
+    events.clear();
+    ASSERT_EQ(4u, reader->poll(events));
+    ASSERT_EQ(6u, reader->lost());
+    ASSERT_EQ(0u, reader->poll(events));
+
+    //delete_all_entry publishes every deleted row
+    ASSERT_EQ(0, sw->delete_all_entry(table_name));
+    events.clear();
+    ASSERT_EQ(4u, reader->poll(events));
+    ASSERT_EQ(SQLITE_DELETE, events[0].op);
+    ASSERT_EQ(0u, reader->poll(events));
+
+    //rows undone by a failing statement of a transaction are not published
+    ASSERT_EQ(0,sw->create_table("dummy_2", "num1 INT UNIQUE"));
+    {
+        SqliteWrapper::Transaction tx(*sw);
+        ASSERT_EQ(0, tx.insert_entry("dummy_2", "(num1) VALUES (1)"));
+        ASSERT_NE(0, tx.insert_entry("dummy_2", "(num1) VALUES (2), (1)"));
+        {
+            SqliteWrapper::Transaction sp(tx);
+            ASSERT_NE(0, sp.insert_entry("dummy_2", "(num1) VALUES (3), (1)"));
+            ASSERT_EQ(0, sp.commit());
+        }
+        ASSERT_EQ(0, tx.commit());
+    }
+    events.clear();
+    ASSERT_EQ(1u, reader->poll(events));
+    ASSERT_EQ(SQLITE_INSERT, events[0].op);
+    ASSERT_STREQ("dummy_2", events[0].table);
+}
+TEST_F(TestSqliteWrapper, test_ttl_reap)
+{
+    ASSERT_TRUE(sw != nullptr);
+    ASSERT_TRUE(sw->is_ok());
+
+    std::string table_name = "dummy_1";
+    int64_t now = (int64_t)time(nullptr);
+
+    //create table
+    {
+        std::string sql_str = "num1 INT, ts INT";
+
+        ASSERT_EQ(0,sw->create_table(table_name, sql_str));
+    }
+    //25 expired rows, interleaved with 5 fresh ones
+    for (int i = 0; i < 30; i++) {
+        int64_t ts = (i % 6 == 0) ? now : now - 100;
+        std::string sql_str = "(num1, ts) VALUES (" + std::to_string(i) +
+            ", " + std::to_string(ts) + ")";
+        ASSERT_EQ(0,sw->insert_entry(table_name, sql_str));
+    }
+    ASSERT_EQ(0, sw->set_ttl(table_name, "ts", 60, 4));
+    ASSERT_EQ(25, sw->reap_expired());
+    ASSERT_EQ(0, sw->reap_expired());
+    //fresh rows are kept
+    {
+        int64_t count = 0;
+        std::vector<SqliteWrapper::GetItem> out = {
+            SqliteWrapper::GetItem(&count, sizeof(count))
+        };
+        ASSERT_EQ(0, sw->get_entry(out, table_name, "count(*)", ""));
+        ASSERT_EQ(5, count);
+    }
+    //background reaper
+    ASSERT_EQ(0, sw->insert_entry(table_name,
+                "(num1, ts) VALUES (99, " + std::to_string(now - 100) + ")"));
+    ASSERT_EQ(0, sw->start_reaper(10));
+    ASSERT_EQ(-EBUSY, sw->start_reaper(10));
+    for (int i = 0; i < 200 && sw->peek_entry(table_name, "WHERE num1 = 99"); i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    ASSERT_FALSE(sw->peek_entry(table_name, "WHERE num1 = 99"));
+    sw->stop_reaper();
+}
+TEST_F(TestSqliteWrapper, test_maintenance_checkpoint)
+{
+    ASSERT_TRUE(sw != nullptr);
+    ASSERT_TRUE(sw->is_ok());
+
+    std::string table_name = "dummy_1";
+    struct stat st;
+
+    //switch the database to WAL mode, persistent across connections
+    delete sw;
+    {
+        sqlite3 *db = nullptr;
+        ASSERT_EQ(SQLITE_OK, sqlite3_open(db_file_path.c_str(), &db));
+        ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "PRAGMA journal_mode=WAL;",
+                    0, 0, nullptr));
+        sqlite3_close(db);
+    }
+    sw = new SqliteWrapper(db_file_path);
+    ASSERT_TRUE(sw->is_ok());
+    ASSERT_EQ(0, stat(db_file_path.c_str(), &st));
+    auto initial_size = st.st_size;
+
+    SqliteWrapper::MaintenanceConfig config;
+    config.idle_ms = 10;
+    config.checkpoint_min_frames = 1;
+    ASSERT_EQ(0, sw->start_maintenance(config));
+    ASSERT_EQ(-EBUSY, sw->start_maintenance(config));
+    {
+        std::string sql_str = "num1 INT, str1 TEXT";
+
+        ASSERT_EQ(0,sw->create_table(table_name, sql_str));
+    }
+    ASSERT_EQ(0, sw->insert_entry(table_name, "(num1) VALUES (1)"));
+    //once idle, the WAL gets checkpointed into the database file
+    for (int i = 0; i < 200; i++) {
+        ASSERT_EQ(0, stat(db_file_path.c_str(), &st));
+        if (st.st_size > initial_size)
+            break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    ASSERT_GT(st.st_size, initial_size);
+    sw->stop_maintenance();
+    ASSERT_TRUE(sw->peek_entry(table_name, "WHERE num1 = 1"));
+
+    //never idle: past the hard limit the committing call checkpoints
+    config.idle_ms = 3600 * 1000;
+    config.checkpoint_hard_frames = 4;
+    ASSERT_EQ(0, sw->start_maintenance(config));
+    initial_size = st.st_size;
+    for (int i = 0; i < 64; i++)
+        ASSERT_EQ(0, sw->insert_entry(table_name, "(num1, str1) VALUES (2, "
+                    "printf('%.2000c', 'x'))"));
+    ASSERT_EQ(0, stat(db_file_path.c_str(), &st));
+    ASSERT_GT(st.st_size, initial_size);
+    sw->stop_maintenance();
+}
+TEST_F(TestSqliteWrapper, test_transaction)
+{
+    ASSERT_TRUE(sw != nullptr);
+    ASSERT_TRUE(sw->is_ok());
+
+    std::string table_name = "dummy_1";
+
+    //create table
+    {
+        std::string sql_str = "num1 INT, str1 TEXT";
+
+        ASSERT_EQ(0,sw->create_table(table_name, sql_str));
+    }
+    //commit
+    {
+        SqliteWrapper::Transaction tx(*sw);
+        ASSERT_TRUE(tx.is_ok());
+        for (int i = 0; i < 10; i++)
+            ASSERT_EQ(0, tx.insert_entry(table_name,
+                        "(num1) VALUES (" + std::to_string(i) + ")"));
+        ASSERT_EQ(0, tx.update_entry(table_name, "str1 = \"a\"",
+                    "WHERE num1 = 1"));
+        ASSERT_TRUE(tx.peek_entry(table_name, "WHERE str1 = \"a\""));
+        ASSERT_EQ(0, tx.commit());
+        ASSERT_FALSE(tx.is_ok());
+        ASSERT_EQ(-EINVAL, tx.commit());
+    }
+    ASSERT_TRUE(sw->peek_entry(table_name, "WHERE num1 = 9"));
+    //rollback on destruction
+    {
+        SqliteWrapper::Transaction tx(*sw);
+        ASSERT_EQ(0, tx.delete_all_entry(table_name));
+        ASSERT_FALSE(tx.peek_entry(table_name, "WHERE num1 = 9"));
+    }
+    ASSERT_TRUE(sw->peek_entry(table_name, "WHERE num1 = 9"));
+    //nested savepoints
+    {
+        SqliteWrapper::Transaction tx(*sw);
+        ASSERT_EQ(0, tx.insert_entry(table_name, "(num1) VALUES (100)"));
+        {
+            SqliteWrapper::Transaction sp(tx);
+            ASSERT_TRUE(sp.is_ok());
+            ASSERT_EQ(0, sp.insert_entry(table_name, "(num1) VALUES (101)"));
+            //parent cannot end before the nested one
+            ASSERT_EQ(-EBUSY, tx.commit());
+            //nor nest a second one beside it
+            SqliteWrapper::Transaction sibling(tx);
+            ASSERT_FALSE(sibling.is_ok());
+        }
+        {
+            SqliteWrapper::Transaction sp(tx);
+            ASSERT_EQ(0, sp.insert_entry(table_name, "(num1) VALUES (102)"));
+            ASSERT_EQ(0, sp.commit());
+        }
+        ASSERT_EQ(0, tx.commit());
+    }
+    ASSERT_TRUE(sw->peek_entry(table_name, "WHERE num1 = 100"));
+    ASSERT_FALSE(sw->peek_entry(table_name, "WHERE num1 = 101"));
+    ASSERT_TRUE(sw->peek_entry(table_name, "WHERE num1 = 102"));
+}
+TEST_F(TestSqliteWrapper, test_trace_record)
+{
+    ASSERT_TRUE(sw != nullptr);
+    ASSERT_TRUE(sw->is_ok());
+
+    std::string table_name = "dummy_1";
+    std::string trace_path = "./test.trace";
+    std::vector<uint8_t> src_data = {65, 66, 67, 68, 69, 70};
+
+    ASSERT_EQ(0, sw->start_trace(trace_path));
+    ASSERT_EQ(0, sw->create_table(table_name, "num1 INT, data1 BLOB"));
+    {
+        std::map<const std::string, std::vector<uint8_t>*> blobs = {
+            std::make_pair("@_p1", &src_data)
+        };
+        ASSERT_EQ(0, sw->insert_entry(table_name,
+                    "(num1, data1) VALUES (1, @_p1)", &blobs));
+    }
+    {
+        SqliteWrapper::Transaction tx(*sw);
+        ASSERT_EQ(0, tx.delete_entry(table_name, "WHERE num1 = 1"));
+    }
+    sw->stop_trace();
+    //rolled back, and not recorded anymore
+    ASSERT_TRUE(sw->peek_entry(table_name, "WHERE num1 = 1"));
+
+    TraceReader reader;
+    TraceRecord rec;
+    std::vector<uint8_t> methods;
+    ASSERT_EQ(0, reader.open(trace_path));
+    while (reader.read(rec) == 0) {
+        methods.push_back(rec.method);
+        if (rec.method == TRACE_INSERT_ENTRY) {
+            ASSERT_EQ(2u, rec.args.size());
+            ASSERT_EQ(table_name, rec.args[0]);
+            ASSERT_EQ(1u, rec.blobs.size());
+            ASSERT_EQ("@_p1", rec.blobs[0].name);
+            ASSERT_EQ(src_data.size(), rec.blobs[0].size);
+        }
+    }
+    ASSERT_EQ(std::vector<uint8_t>({TRACE_CREATE_TABLE, TRACE_INSERT_ENTRY,
+                TRACE_TX_BEGIN, TRACE_DELETE_ENTRY, TRACE_TX_ROLLBACK}),
+            methods);
+    remove(trace_path.c_str());
+}
+TEST_F(TestSqliteWrapper, test_trace_replay)
+{
+    ASSERT_TRUE(sw != nullptr);
+    ASSERT_TRUE(sw->is_ok());
+
+    std::string table_name = "dummy_1";
+    std::string trace_path = "./test.trace";
+
+    ASSERT_EQ(0, sw->create_table(table_name, "num1 INT"));
+    //the first thread ends inside its transaction, the second one must
+    //still get the connection when both replay on a single thread
+    {
+        TraceWriter writer;
+        TraceRecord begin;
+        TraceRecord in_tx;
+        TraceRecord after;
+
+        begin.method = TRACE_TX_BEGIN;
+        in_tx.method = TRACE_INSERT_ENTRY;
+        in_tx.ts_ns = 1;
+        in_tx.args = {table_name, "(num1) VALUES (1)"};
+        after.method = TRACE_INSERT_ENTRY;
+        after.ts_ns = 2;
+        after.args = {table_name, "(num1) VALUES (2)"};
+        ASSERT_EQ(0, writer.open(trace_path));
+        std::thread([&]() {
+            writer.write(begin);
+            writer.write(in_tx);
+        }).join();
+        ASSERT_EQ(0, writer.write(after));
+    }
+    std::string cmd = std::string("timeout 10 ") + REPLAY_BIN + " -m -t 1 " +
+        trace_path + " " + db_file_path + " > /dev/null";
+    ASSERT_EQ(0, system(cmd.c_str()));
+    ASSERT_FALSE(sw->peek_entry(table_name, "WHERE num1 = 1"));
+    ASSERT_TRUE(sw->peek_entry(table_name, "WHERE num1 = 2"));
+
+    //a corrupted string length fails the record, without allocating it
+    {
+        FILE *fp = fopen(trace_path.c_str(), "ab");
+        uint8_t head[34] = {TRACE_PEEK_ENTRY};
+        uint8_t nargs = 1;
+        uint32_t len = 0xfffffff0;
+
+        ASSERT_TRUE(fp != nullptr);
+        fwrite(head, sizeof(head), 1, fp);
+        fwrite(&nargs, sizeof(nargs), 1, fp);
+        fwrite(&len, sizeof(len), 1, fp);
+        fclose(fp);
+    }
+    TraceReader reader;
+    TraceRecord rec;
+    int ret;
+    ASSERT_EQ(0, reader.open(trace_path));
+    while ((ret = reader.read(rec)) == 0)
+        ;
+    ASSERT_EQ(-EINVAL, ret);
+    remove(trace_path.c_str());
+}
+TEST_F(TestSqliteWrapper, test_register_function)
+{
+    ASSERT_TRUE(sw != nullptr);
+    ASSERT_TRUE(sw->is_ok());
+
+    std::string table_name = "dummy_1";
+
+    //create table
+    {
+        std::string sql_str = "num1 INT, str1 TEXT";
+
+        ASSERT_EQ(0,sw->create_table(table_name, sql_str));
+    }
+    for (int i = 1; i <= 10; i++) {
+        std::string sql_str = "(num1, str1) VALUES (" + std::to_string(i) +
+            ", \"s" + std::to_string(i) + "\")";
+        ASSERT_EQ(0,sw->insert_entry(table_name, sql_str));
+    }
+    ASSERT_EQ(0, sw->register_function("is_even",
+                [](int64_t x) { return x % 2 == 0; }));
+    ASSERT_EQ(0, sw->register_function("tag",
+                [](const std::string &s, int n) {
+                    return s + "#" + std::to_string(n);
+                }));
+    ASSERT_EQ(0, sw->register_aggregate<std::string>("join_str",
+                [](std::string &acc, const std::string &s) {
+                    acc += acc.empty() ? s : "," + s;
+                },
+                [](std::string &acc) { return acc; }));
+
+    //scalar function as a filter
+    {
+        int64_t count = 0;
+        std::vector<SqliteWrapper::GetItem> out = {
+            SqliteWrapper::GetItem(&count, sizeof(count))
+        };
+        ASSERT_EQ(0, sw->get_entry(out, table_name, "count(*)",
+                    "WHERE is_even(num1)"));
+        ASSERT_EQ(5, count);
+    }
+    //scalar and aggregate functions as values
+    {
+        std::string tagged, joined;
+        auto copy_tagged = [&tagged](const void* src, uint32_t size) {
+            tagged.assign((const char *)src, size);
+            return 0;
+        };
+        auto copy_joined = [&joined](const void* src, uint32_t size) {
+            joined.assign((const char *)src, size);
+            return 0;
+        };
+        std::vector<SqliteWrapper::GetItem> out = {
+            SqliteWrapper::GetItem(nullptr, 0, copy_tagged)
+        };
+        ASSERT_EQ(0, sw->get_entry(out, table_name, "tag(str1, num1)",
+                    "WHERE num1 = 3"));
+        ASSERT_EQ("s3#3", tagged);
+
+        out = {SqliteWrapper::GetItem(nullptr, 0, copy_joined)};
+        ASSERT_EQ(0, sw->get_entry(out, table_name, "join_str(str1)",
+                    "WHERE num1 <= 3"));
+        ASSERT_EQ("s1,s2,s3", joined);
+    }
+}
+TEST_F(TestSqliteWrapper, test_io_stats)
+{
+    ASSERT_TRUE(sw != nullptr);
+    ASSERT_TRUE(sw->is_ok());
+
+    std::string table_name = "dummy_1";
+    SqliteWrapper::IoStats stats;
+
+    ASSERT_EQ(-EINVAL, sw->get_io_stats(stats));
+    delete sw;
+    SqliteWrapper::Options options;
+    options.io_stats = true;
+    sw = new SqliteWrapper(db_file_path, options);
+    ASSERT_TRUE(sw->is_ok());
+
+    ASSERT_EQ(0, sw->create_table(table_name, "num1 INT, str1 TEXT"));
+    sw->reset_io_stats();
+    ASSERT_EQ(0, sw->insert_entry(table_name, "(num1) VALUES (1)"));
+    ASSERT_EQ(0, sw->get_io_stats(stats));
+    {
+        auto const &db = stats.counters[SqliteWrapper::OP_INSERT_ENTRY]
+            [SqliteWrapper::IO_FILE_DB];
+        auto const &journal = stats.counters[SqliteWrapper::OP_INSERT_ENTRY]
+            [SqliteWrapper::IO_FILE_JOURNAL];
+        //a commit in rollback journal mode writes and syncs both files
+        ASSERT_GT(db.writes, 0u);
+        ASSERT_GE(db.write_bytes, db.writes);
+        ASSERT_GT(db.syncs, 0u);
+        ASSERT_GT(journal.writes, 0u);
+        //nothing accounted to the other operations
+        ASSERT_EQ(0u, stats.counters[SqliteWrapper::OP_GET_ENTRY]
+                [SqliteWrapper::IO_FILE_DB].writes);
+    }
+    ASSERT_TRUE(sw->peek_entry(table_name, "WHERE num1 = 1"));
+}
+TEST_F(TestSqliteWrapper, test_lock_policy)
+{
+    std::string table_name = "dummy_1";
+
+    //single thread, no locking at all
+    delete sw;
+    {
+        SqliteWrapper::Options options;
+        options.lock_policy = SqliteWrapper::LOCK_NONE;
+        sw = new SqliteWrapper(db_file_path, options);
+    }
+    ASSERT_TRUE(sw->is_ok());
+    ASSERT_EQ(0, sw->create_table(table_name, "num1 INT, str1 TEXT"));
+    ASSERT_EQ(0, sw->insert_entry(table_name, "(num1) VALUES (1)"));
+    ASSERT_TRUE(sw->peek_entry(table_name, "WHERE num1 = 1"));
+    {
+        SqliteWrapper::Transaction tx(*sw);
+        ASSERT_EQ(0, tx.insert_entry(table_name, "(num1) VALUES (2)"));
+        ASSERT_EQ(0, tx.commit());
+    }
+    ASSERT_EQ(-EINVAL, sw->start_reaper(10));
+    ASSERT_EQ(-EINVAL, sw->start_maintenance());
+
+    //readers share the connection, writers are exclusive
+    delete sw;
+    {
+        SqliteWrapper::Options options;
+        options.lock_policy = SqliteWrapper::LOCK_SHARED;
+        sw = new SqliteWrapper(db_file_path, options);
+    }
+    ASSERT_TRUE(sw->is_ok());
+    {
+        std::vector<std::thread> threads;
+        std::atomic<int> errors{0};
+
+        for (int t = 0; t < 4; t++) {
+            threads.emplace_back([this, t, &table_name, &errors]() {
+                for (int i = 0; i < 50; i++) {
+                    int64_t count;
+                    std::vector<SqliteWrapper::GetItem> out = {
+                        SqliteWrapper::GetItem(&count, sizeof(count))
+                    };
+                    if (t == 0 && sw->insert_entry(table_name,
+                                "(num1) VALUES (3)") != 0)
+                        errors++;
+                    if (sw->get_entry(out, table_name, "count(*)", "") != 0 ||
+                            count < 2)
+                        errors++;
+                }
+            });
+        }
+        for (auto &thread : threads)
+            thread.join();
+        ASSERT_EQ(0, errors);
+    }
+    {
+        int64_t count = 0;
+        std::vector<SqliteWrapper::GetItem> out = {
+            SqliteWrapper::GetItem(&count, sizeof(count))
+        };
+        ASSERT_EQ(0, sw->get_entry(out, table_name, "count(*)", ""));
+        ASSERT_EQ(52, count);
+    }
+}
+TEST_F(TestSqliteWrapper, test_write_back)
+{
+    ASSERT_TRUE(sw != nullptr);
+    ASSERT_TRUE(sw->is_ok());
+
+    std::string table_name = "dummy_1";
+    std::unique_ptr<ChangeRing::Reader> reader;
+    std::vector<ChangeEvent> events;
+    std::vector<SqliteWrapper::Value> values;
+    SqliteWrapper::WriteBackConfig config;
+
+    config.max_keys = 1000;
+    config.max_delay_ms = 50;
+    ASSERT_EQ(0, sw->create_table(table_name,
+                "key INTEGER PRIMARY KEY, num1 INT, str1 TEXT"));
+    ASSERT_EQ(-EINVAL, sw->put_entry(table_name, 1, {{"num1", 1}}));
+    ASSERT_EQ(0, sw->enable_write_back(table_name, "key", config));
+    ASSERT_EQ(0, sw->enable_change_capture());
+    ASSERT_EQ(0, sw->subscribe_changes(reader));
+
+    //hot key updates coalesce in memory, columns merge
+    for (int i = 0; i < 500; i++)
+        ASSERT_EQ(0, sw->put_entry(table_name, 1, {{"num1", i}}));
+    ASSERT_EQ(0, sw->put_entry(table_name, 1,
+                {{"str1", std::string("hot")}}));
+    ASSERT_EQ(0, sw->get_key_entry(values, table_name, 1,
+                {"key", "num1", "str1"}));
+    ASSERT_EQ(1, values[0].i);
+    ASSERT_EQ(499, values[1].i);
+    ASSERT_EQ("hot", std::string(values[2].bytes.begin(),
+                values[2].bytes.end()));
+    ASSERT_EQ(-ENOENT, sw->get_key_entry(values, table_name, 2, {"num1"}));
+
+    //flushed by the timer, one upsert for the 501 updates
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    ASSERT_EQ(1u, reader->poll(events));
+    ASSERT_EQ(SQLITE_INSERT, events[0].op);
+    {
+        SqliteWrapper other(db_file_path);
+        int num = 0;
+        std::vector<SqliteWrapper::GetItem> out = {
+            SqliteWrapper::GetItem(&num, sizeof(num))
+        };
+
+        ASSERT_EQ(0, other.get_entry(out, table_name, "num1",
+                    "WHERE key = 1"));
+        ASSERT_EQ(499, num);
+    }
+
+    //SQL calls on the table see the buffered state
+    ASSERT_EQ(0, sw->put_entry(table_name, 1, {{"num1", 7}}));
+    ASSERT_EQ(0, sw->put_entry(table_name, 2, {{"num1", 8}}));
+    ASSERT_TRUE(sw->peek_entry(table_name, "WHERE key = 2 AND num1 = 8"));
+    ASSERT_EQ(0, sw->get_key_entry(values, table_name, 1, {"num1", "str1"}));
+    ASSERT_EQ(7, values[0].i);
+    ASSERT_EQ("hot", std::string(values[1].bytes.begin(),
+                values[1].bytes.end()));
+    //a REAL key equal to an INTEGER one is the same key
+    ASSERT_EQ(0, sw->put_entry(table_name, 1.0, {{"num1", 6}}));
+    ASSERT_EQ(0, sw->get_key_entry(values, table_name, 1, {"num1"}));
+    ASSERT_EQ(6, values[0].i);
+
+    //flushed on close
+    ASSERT_EQ(0, sw->put_entry(table_name, 3, {{"num1", 9}}));
+    delete sw;
+    sw = new SqliteWrapper(db_file_path);
+    ASSERT_TRUE(sw->peek_entry(table_name, "WHERE key = 3 AND num1 = 9"));
+
+    //the window is bounded by a timer thread
+    delete sw;
+    {
+        SqliteWrapper::Options options;
+        options.lock_policy = SqliteWrapper::LOCK_NONE;
+        sw = new SqliteWrapper(db_file_path, options);
+    }
+    ASSERT_EQ(-EINVAL, sw->enable_write_back(table_name, "key"));
+}
+TEST_F(TestSqliteWrapper, test_table_schema)
+{
+    SqliteWrapper::TableSchema schema;
+    std::string table_sql;
+    std::vector<SqliteWrapper::GetItem> out = {
+        SqliteWrapper::GetItem(&table_sql, 0, [&](const void *src,
+                    uint32_t len) {
+            table_sql.assign((const char *)src, len);
+            return 0;
+        })
+    };
+
+    delete sw;
+    {
+        SqliteWrapper::Options options;
+        options.plan_warnings = true;
+        sw = new SqliteWrapper(db_file_path, options);
+    }
+    ASSERT_TRUE(sw->is_ok());
+
+    schema.name = "kv";
+    schema.columns = {
+        {"key", SqliteWrapper::COL_TEXT, true, ""},
+        {"value", SqliteWrapper::COL_BLOB, false, ""},
+        {"ts", SqliteWrapper::COL_INTEGER, true, "0"},
+    };
+    schema.primary_key = {"key"};
+    schema.without_rowid = true;
+    schema.strict = true;
+    ASSERT_EQ(0, sw->create_table(schema));
+    ASSERT_EQ(0, sw->get_entry(out, "sqlite_master", "sql",
+                "WHERE name = 'kv'"));
+    ASSERT_EQ("CREATE TABLE kv (key TEXT NOT NULL, value BLOB, "
+            "ts INTEGER NOT NULL DEFAULT (0), PRIMARY KEY (key)) "
+            "WITHOUT ROWID, STRICT", table_sql);
+
+    //idempotent, new indexes are added
+    SqliteWrapper::TableSchema::Index idx;
+    idx.columns = {"ts DESC"};
+    idx.covering = {"value"};
+    idx.where = "ts > 0";
+    schema.indexes.push_back(idx);
+    ASSERT_EQ(0, sw->create_table(schema));
+    ASSERT_EQ(0, sw->create_table(schema));
+    ASSERT_TRUE(sw->peek_entry("sqlite_master",
+                "WHERE type = 'index' AND name = 'kv_ts_idx'"));
+
+    //STRICT enforces the column types
+    ASSERT_EQ(0, sw->insert_entry("kv",
+                "(key, value, ts) VALUES ('a', x'01', 5)"));
+    ASSERT_NE(0, sw->insert_entry("kv",
+                "(key, value, ts) VALUES ('b', x'01', 'late')"));
+
+    //key lookups and the covering partial index don't scan, others do
+    uint64_t scans = sw->get_full_scans();  // sqlite_master is scanned
+    sw->peek_entry("kv", "WHERE key = 'a'");
+    ASSERT_EQ(scans, sw->get_full_scans());
+    sw->peek_entry("kv", "WHERE ts > 0 AND ts < 9");
+    ASSERT_EQ(scans, sw->get_full_scans());
+    sw->peek_entry("kv", "WHERE value = x'01'");
+    ASSERT_EQ(scans + 1, sw->get_full_scans());
+    //once per statement
+    sw->peek_entry("kv", "WHERE value = x'01'");
+    ASSERT_EQ(scans + 1, sw->get_full_scans());
+
+    //another definition is refused
+    schema.strict = false;
+    ASSERT_EQ(-EEXIST, sw->create_table(schema));
+    schema.strict = true;
+    schema.indexes[0].where = "ts > 1";
+    ASSERT_EQ(-EEXIST, sw->create_table(schema));
+    schema.without_rowid = true;
+    schema.primary_key.clear();
+    ASSERT_EQ(-EINVAL, sw->create_table(schema));
+}
+TEST_F(TestSqliteWrapper, test_parallel_scan)
+{
+    std::string table_name = "dummy_1";
+    typedef std::vector<SqliteWrapper::Value> Row;
+    int64_t expected = 0;
+
+    //WAL mode, writers go on during the scan
+    delete sw;
+    {
+        sqlite3 *db = nullptr;
+        ASSERT_EQ(SQLITE_OK, sqlite3_open(db_file_path.c_str(), &db));
+        ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "PRAGMA journal_mode=WAL;",
+                    0, 0, nullptr));
+        sqlite3_close(db);
+    }
+    sw = new SqliteWrapper(db_file_path);
+    ASSERT_TRUE(sw->is_ok());
+    ASSERT_EQ(0, sw->create_table(table_name,
+                "num1 INT, str1 TEXT PRIMARY KEY"));
+    {
+        SqliteWrapper::Transaction tx(*sw);
+        for (int i = 0; i < 10000; i++) {
+            ASSERT_EQ(0, tx.insert_entry(table_name,
+                        "(num1, str1) VALUES (" + std::to_string(i) +
+                        ", 'k" + std::to_string(i) + "')"));
+            expected += 2 * i;
+        }
+        ASSERT_EQ(0, tx.commit());
+    }
+    ASSERT_EQ(0, sw->register_function("twice", [](int64_t x) {
+        return 2 * x;
+    }));
+
+    //rowid ranges, with a registered function
+    {
+        int64_t sum = 0;
+        ASSERT_EQ(0, sw->parallel_scan(sum, table_name, "twice(num1)", "",
+                    [](int64_t &s, const Row &row) { s += row[0].i; },
+                    [](int64_t &s, int64_t &part) { s += part; }, 4));
+        ASSERT_EQ(expected, sum);
+    }
+    //text key quantiles, with a filter
+    {
+        std::vector<std::string> keys;
+        ASSERT_EQ(0, sw->parallel_scan(keys, table_name, "str1",
+                    "num1 % 10 = 0",
+                    [](std::vector<std::string> &k, const Row &row) {
+                        k.emplace_back(row[0].bytes.begin(),
+                                row[0].bytes.end());
+                    },
+                    [](std::vector<std::string> &k,
+                        std::vector<std::string> &part) {
+                        k.insert(k.end(), part.begin(), part.end());
+                    }, 3, "str1"));
+        ASSERT_EQ(1000u, keys.size());
+        std::sort(keys.begin(), keys.end());
+        ASSERT_TRUE(std::unique(keys.begin(), keys.end()) == keys.end());
+    }
+    //rows committed during the scan are not seen
+    {
+        int64_t count = 0;
+        bool inserted = false;
+        ASSERT_EQ(0, sw->parallel_scan(count, table_name, "num1", "",
+                    [&](int64_t &c, const Row &row) {
+                        (void)row;
+                        if (!inserted) {
+                            inserted = true;
+                            ASSERT_EQ(0, sw->insert_entry(table_name,
+                                        "(num1, str1) VALUES (-1, 'late')"));
+                        }
+                        c++;
+                    },
+                    [](int64_t &c, int64_t &part) { c += part; }, 1));
+        ASSERT_TRUE(inserted);
+        ASSERT_EQ(10000, count);
+    }
+    ASSERT_EQ(-EINVAL, sw->parallel_scan(expected, table_name, "nope", "",
+                [](int64_t &, const Row &) {},
+                [](int64_t &, int64_t &) {}, 2));
+}
+TEST_F(TestSqliteWrapper, test_backup)
+{
+    ASSERT_TRUE(sw != nullptr);
+    ASSERT_TRUE(sw->is_ok());
+
+    std::string table_name = "dummy_1";
+    std::string backup_path = db_file_path + ".bak";
+    std::vector<uint8_t> data(2048, 0x5a);
+    std::map<const std::string, std::vector<uint8_t>*> blobs = {
+        {":data", &data}
+    };
+    SqliteWrapper::BackupProgress progress;
+    std::atomic<int> steps{0};
+
+    ASSERT_EQ(-ENOENT, sw->wait_backup());
+    ASSERT_EQ(0, sw->create_table(table_name, "num1 INT, data BLOB"));
+    {
+        SqliteWrapper::Transaction tx(*sw);
+        for (int i = 0; i < 200; i++)
+            ASSERT_EQ(0, tx.insert_entry(table_name,
+                        "(num1, data) VALUES (1, :data)", &blobs));
+        ASSERT_EQ(0, tx.commit());
+    }
+
+    //writers go on between the steps, their changes reach the copy
+    ASSERT_EQ(0, sw->backup_to(backup_path, 8, 1,
+                [&steps](const SqliteWrapper::BackupProgress &p) {
+                    (void)p;
+                    steps++;
+                }));
+    ASSERT_EQ(-EBUSY, sw->backup_to(backup_path));
+    for (int i = 0; i < 20; i++)
+        ASSERT_EQ(0, sw->insert_entry(table_name,
+                    "(num1, data) VALUES (2, :data)", &blobs));
+    ASSERT_EQ(0, sw->wait_backup());
+    ASSERT_EQ(0, sw->get_backup_progress(progress));
+    ASSERT_TRUE(progress.done);
+    ASSERT_EQ(0, progress.remaining);
+    ASSERT_GT(progress.pagecount, 100);
+    ASSERT_GT(steps, 10);
+    {
+        SqliteWrapper copy(backup_path);
+        int64_t count = 0;
+        std::vector<SqliteWrapper::GetItem> out = {
+            SqliteWrapper::GetItem(&count, sizeof(count))
+        };
+
+        ASSERT_EQ(0, copy.get_entry(out, table_name, "count(*)", ""));
+        ASSERT_EQ(220, count);
+    }
+    remove(backup_path.c_str());
+
+    ASSERT_EQ(0u, progress.restarts);
+
+    //cancelled backups leave nothing behind, nor touch other files
+    std::string user_path = backup_path + ".tmp";
+    FILE *fp = fopen(user_path.c_str(), "w");
+    ASSERT_TRUE(fp != nullptr);
+    fclose(fp);
+    ASSERT_EQ(0, sw->backup_to(backup_path, 1, 100));
+    sw->cancel_backup();
+    ASSERT_EQ(-ECANCELED, sw->wait_backup());
+    struct stat st;
+    ASSERT_NE(0, stat(backup_path.c_str(), &st));
+    ASSERT_EQ(0, stat(user_path.c_str(), &st));
+    remove(user_path.c_str());
+    {
+        DIR *dir = opendir(".");
+        struct dirent *ent;
+        std::string prefix = backup_path.substr(2);
+
+        ASSERT_TRUE(dir != nullptr);
+        while ((ent = readdir(dir)) != nullptr)
+            EXPECT_NE(0, strncmp(ent->d_name, prefix.c_str(), prefix.size()));
+        closedir(dir);
+    }
+}
+TEST_F(TestSqliteWrapper, test_deadline)
+{
+    ASSERT_TRUE(sw != nullptr);
+    ASSERT_TRUE(sw->is_ok());
+
+    std::string table_name = "dummy_1";
+    //counting to 1e9 takes way longer than any deadline below
+    std::string slow = "(WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL "
+        "SELECT x + 1 FROM c LIMIT 1000000000) SELECT x FROM c)";
+    int64_t count = 0;
+    std::vector<SqliteWrapper::GetItem> out = {
+        SqliteWrapper::GetItem(&count, sizeof(count))
+    };
+
+    ASSERT_EQ(0, sw->create_table(table_name, "num1 INT, str1 TEXT"));
+    for (int i = 0; i < 10; i++)
+        ASSERT_EQ(0, sw->insert_entry(table_name, "(num1) VALUES (1)"));
+
+    //per call deadline
+    {
+        SqliteWrapper::Timeout timeout(*sw, 50);
+        auto start = std::chrono::steady_clock::now();
+
+        ASSERT_EQ(-ETIMEDOUT, sw->get_entry(out, slow, "count(*)", ""));
+        ASSERT_LT(std::chrono::steady_clock::now() - start,
+                std::chrono::seconds(1));
+        ASSERT_EQ(-ETIMEDOUT, sw->delete_entry(table_name,
+                    "WHERE num1 < (SELECT count(*) FROM " + slow + ")"));
+        ASSERT_FALSE(sw->peek_entry(slow, "WHERE x = 0"));
+    }
+    ASSERT_EQ(3u, sw->get_timeouts());
+    //the interrupted delete removed nothing, later calls run normally
+    ASSERT_EQ(0, sw->get_entry(out, table_name, "count(*)", ""));
+    ASSERT_EQ(10, count);
+
+    //wrapper default, a Timeout of 0 lifts it
+    sw->set_default_timeout(50);
+    {
+        SqliteWrapper::Transaction tx(*sw);
+        ASSERT_EQ(-ETIMEDOUT, tx.get_entry(out, slow, "count(*)", ""));
+        ASSERT_EQ(0, tx.insert_entry(table_name, "(num1) VALUES (2)"));
+        ASSERT_EQ(0, tx.commit());
+    }
+    ASSERT_EQ(4u, sw->get_timeouts());
+    {
+        SqliteWrapper::Timeout timeout(*sw, 0);
+        ASSERT_EQ(0, sw->get_entry(out, "(WITH RECURSIVE c(x) AS (SELECT 1 "
+                    "UNION ALL SELECT x + 1 FROM c LIMIT 1000000) "
+                    "SELECT x FROM c)", "count(*)", ""));
+        ASSERT_EQ(1000000, count);
+    }
+    ASSERT_EQ(0, sw->get_entry(out, table_name, "count(*)", ""));
+    ASSERT_EQ(11, count);
+
+    //an interrupted write rolls the whole transaction back
+    {
+        SqliteWrapper::Transaction tx(*sw);
+        ASSERT_EQ(0, tx.insert_entry(table_name, "(num1) VALUES (3)"));
+        {
+            SqliteWrapper::Transaction sp(tx);
+            ASSERT_EQ(-ETIMEDOUT, sp.delete_entry(table_name,
+                        "WHERE num1 < (SELECT count(*) FROM " + slow + ")"));
+            ASSERT_FALSE(sp.is_ok());
+            ASSERT_EQ(-EINVAL, sp.insert_entry(table_name,
+                        "(num1) VALUES (4)"));
+            ASSERT_EQ(-ECANCELED, sp.commit());
+        }
+        ASSERT_FALSE(tx.is_ok());
+        ASSERT_EQ(-EINVAL, tx.insert_entry(table_name, "(num1) VALUES (4)"));
+        ASSERT_EQ(-ECANCELED, tx.commit());
+    }
+    //the connection is free again and nothing was written
+    ASSERT_EQ(0, sw->get_entry(out, table_name, "count(*)", ""));
+    ASSERT_EQ(11, count);
+    sw->set_default_timeout(0);
+    ASSERT_EQ(0, sw->insert_entry(table_name, "(num1) VALUES (5)"));
+}
+TEST_F(TestSqliteWrapper, test_aggregate)
+{
+    ASSERT_TRUE(sw != nullptr);
+    ASSERT_TRUE(sw->is_ok());
+
+    std::string table_name = "dummy_1";
+    SqliteWrapper::Value value;
+    int64_t count = -1;
+
+    ASSERT_EQ(0, sw->create_table(table_name, "num1 INT, str1 TEXT"));
+    ASSERT_EQ(0, sw->count_entries(count, table_name));
+    ASSERT_EQ(0, count);
+    ASSERT_EQ(0, sw->exists(table_name, ""));
+    ASSERT_EQ(0, sw->aggregate(value, table_name, SqliteWrapper::AGG_SUM,
+                "num1"));
+    ASSERT_EQ(SQLITE_NULL, value.type);
+    ASSERT_GT(0, sw->exists("nope", ""));
+
+    for (int i = 1; i <= 100; i++)
+        ASSERT_EQ(0, sw->insert_entry(table_name, "(num1, str1) VALUES (" +
+                    std::to_string(i) + ", " +
+                    (i % 2 ? "'odd'" : "NULL") + ")"));
+
+    ASSERT_EQ(0, sw->count_entries(count, table_name));
+    ASSERT_EQ(100, count);
+    ASSERT_EQ(0, sw->count_entries(count, table_name, "WHERE num1 > 90"));
+    ASSERT_EQ(10, count);
+    ASSERT_EQ(1, sw->exists(table_name, "WHERE num1 = 42"));
+    ASSERT_EQ(0, sw->exists(table_name, "WHERE num1 = 420"));
+
+    ASSERT_EQ(0, sw->aggregate(value, table_name, SqliteWrapper::AGG_COUNT,
+                "str1"));
+    ASSERT_EQ(50, value.i);
+    ASSERT_EQ(0, sw->aggregate(value, table_name, SqliteWrapper::AGG_MIN,
+                "num1", "WHERE num1 > 10"));
+    ASSERT_EQ(11, value.i);
+    ASSERT_EQ(0, sw->aggregate(value, table_name, SqliteWrapper::AGG_MAX,
+                "num1"));
+    ASSERT_EQ(100, value.i);
+    ASSERT_EQ(0, sw->aggregate(value, table_name, SqliteWrapper::AGG_SUM,
+                "num1"));
+    ASSERT_EQ(SQLITE_INTEGER, value.type);
+    ASSERT_EQ(5050, value.i);
+    ASSERT_EQ(-EINVAL, sw->aggregate(value, table_name,
+                SqliteWrapper::AGG_MAX_FN, "num1"));
+
+    //also inside a transaction, seeing its own changes
+    {
+        SqliteWrapper::Transaction tx(*sw);
+        ASSERT_EQ(0, tx.delete_entry(table_name, "WHERE num1 > 50"));
+        ASSERT_EQ(0, tx.count_entries(count, table_name));
+        ASSERT_EQ(50, count);
+        ASSERT_EQ(0, tx.exists(table_name, "WHERE num1 = 60"));
+        ASSERT_EQ(0, tx.aggregate(value, table_name, SqliteWrapper::AGG_MAX,
+                    "num1"));
+        ASSERT_EQ(50, value.i);
+    }
+    ASSERT_EQ(0, sw->count_entries(count, table_name));
+    ASSERT_EQ(100, count);
+}
+TEST_F(TestSqliteWrapper, test_allocator)
+{
+    ASSERT_TRUE(sw != nullptr);
+    delete sw;
+    sw = nullptr;
+    //pools can only be installed while SQLite is not initialized
+    ASSERT_EQ(SQLITE_OK, sqlite3_shutdown());
+
+    SqliteWrapper::AllocatorConfig config;
+    SqliteWrapper::MemoryStats stats;
+    std::string table_name = "dummy_1";
+    int64_t count = -1;
+
+    config.thread_cache_blocks = 16;
+    ASSERT_EQ(0, SqliteWrapper::install_allocator(config));
+    sw = new SqliteWrapper(db_file_path);
+    ASSERT_TRUE(sw->is_ok());
+    ASSERT_EQ(0, sw->create_table(table_name, "num1 INT, str1 TEXT"));
+
+    auto writer = [&](int base) {
+        for (int i = base; i < base + 200; i++)
+            ASSERT_EQ(0, sw->insert_entry(table_name, "(num1, str1) VALUES (" +
+                        std::to_string(i) + ", '" +
+                        std::string(i % 300 + 1, 'x') + "')"));
+    };
+    std::thread t1(writer, 0), t2(writer, 1000);
+    t1.join();
+    t2.join();
+    //a row larger than the biggest size class
+    ASSERT_EQ(0, sw->insert_entry(table_name, "(num1, str1) VALUES (-1, '" +
+                std::string(20000, 'y') + "')"));
+    ASSERT_EQ(0, sw->count_entries(count, table_name,
+                "WHERE num1 = -1 AND length(str1) = 20000"));
+    ASSERT_EQ(1, count);
+
+    SqliteWrapper::get_memory_stats(stats);
+    ASSERT_GT(stats.used, 0);
+    ASSERT_GE(stats.high_water, stats.used);
+    ASSERT_GE(stats.pool_reserved, stats.used);
+    ASSERT_EQ(0, stats.soft_heap_limit);
+    ASSERT_EQ(0, stats.hard_heap_limit);
+
+    //only the limits change once SQLite is initialized
+    ASSERT_EQ(0, SqliteWrapper::install_allocator(config));
+    config.thread_cache_blocks = 32;
+    ASSERT_EQ(-EBUSY, SqliteWrapper::install_allocator(config));
+    config.thread_cache_blocks = 16;
+    config.pools = false;
+    ASSERT_EQ(-EBUSY, SqliteWrapper::install_allocator(config));
+    config.pools = true;
+    config.hard_heap_limit = stats.used + 256 * 1024;
+    config.soft_heap_limit = stats.used + 128 * 1024;
+    ASSERT_EQ(0, SqliteWrapper::install_allocator(config));
+    SqliteWrapper::get_memory_stats(stats, true);
+    ASSERT_EQ(config.soft_heap_limit, stats.soft_heap_limit);
+    ASSERT_EQ(config.hard_heap_limit, stats.hard_heap_limit);
+    ASSERT_NE(0, sw->insert_entry(table_name, "(num1, str1) VALUES (-2, '" +
+                std::string(1024 * 1024, 'z') + "')"));
+
+    config.hard_heap_limit = 0;
+    config.soft_heap_limit = 0;
+    ASSERT_EQ(0, SqliteWrapper::install_allocator(config));
+    ASSERT_EQ(0, sw->insert_entry(table_name, "(num1, str1) VALUES (-2, '" +
+                std::string(1024 * 1024, 'z') + "')"));
+    ASSERT_EQ(0, sw->count_entries(count, table_name));
+    ASSERT_EQ(402, count);
+}
+TEST_F(TestSqliteWrapper, test_sched_policy)
+{
+    ASSERT_TRUE(sw != nullptr);
+    delete sw;
+    sw = nullptr;
+
+    std::string table_name = "dummy_1";
+    SqliteWrapper::SchedStats stats;
+    //readers queued behind a writer see its row unless they go first
+    auto run = [&](SqliteWrapper::SchedPolicy policy) {
+        SqliteWrapper::Options options;
+        std::vector<int64_t> seen(3, -1);
+        std::vector<std::thread> readers;
+        std::thread writer;
+
+        options.sched_policy = policy;
+        options.write_max_wait_ms = 10000;
+        sw = new SqliteWrapper(db_file_path, options);
+        EXPECT_EQ(0, sw->create_table(table_name, "num1 INT"));
+        EXPECT_EQ(0, sw->delete_all_entry(table_name));
+        sw->reset_sched_stats();
+        {
+            SqliteWrapper::Transaction tx(*sw);
+            auto wait_queued = [&](uint32_t reads, uint32_t writes) {
+                auto limit = std::chrono::steady_clock::now() +
+                    std::chrono::seconds(5);
+
+                do {
+                    if (std::chrono::steady_clock::now() > limit) {
+                        ADD_FAILURE() << "never queued " << reads <<
+                            " reads and " << writes << " writes";
+                        return;
+                    }
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    EXPECT_EQ(0, sw->get_sched_stats(stats));
+                } while (stats.reads.queued != reads ||
+                        stats.writes.queued != writes);
+            };
+            writer = std::thread([&] {
+                EXPECT_EQ(0, sw->insert_entry(table_name, "(num1) VALUES (1)"));
+            });
+            wait_queued(0, 1);
+            for (int i = 0; i < 3; i++) {
+                readers.emplace_back([&, i] {
+                    EXPECT_EQ(0, sw->count_entries(seen[i], table_name));
+                });
+                wait_queued(i + 1, 1);
+            }
+        }
+        writer.join();
+        for (auto &t : readers)
+            t.join();
+        EXPECT_EQ(0, sw->get_sched_stats(stats));
+        delete sw;
+        sw = nullptr;
+        return seen;
+    };
+
+    ASSERT_EQ(std::vector<int64_t>({1, 1, 1}),
+            run(SqliteWrapper::SCHED_ARRIVAL));
+    ASSERT_EQ(1u, stats.writes.max_queued);
+    ASSERT_EQ(3u, stats.reads.max_queued);
+    ASSERT_EQ(0u, stats.reads.queued);
+    ASSERT_EQ(std::vector<int64_t>({0, 0, 0}),
+            run(SqliteWrapper::SCHED_READ_FIRST));
+    ASSERT_EQ(3u, stats.reads.granted);
+    ASSERT_GT(stats.reads.p99_wait_ns, 0u);
+    ASSERT_LE(stats.reads.p50_wait_ns, stats.reads.p99_wait_ns);
+    ASSERT_LE(stats.reads.p99_wait_ns, stats.reads.max_wait_ns);
+    ASSERT_GT(stats.writes.wait_ns, stats.reads.max_wait_ns);
+
+    SqliteWrapper::Options options;
+    options.lock_policy = SqliteWrapper::LOCK_SHARED;
+    sw = new SqliteWrapper(db_file_path, options);
+    ASSERT_EQ(-EINVAL, sw->get_sched_stats(stats));
+}
+TEST_F(TestSqliteWrapper, test_prewarm)
+{
+    ASSERT_TRUE(sw != nullptr);
+    ASSERT_TRUE(sw->is_ok());
+
+    std::string table_name = "dummy_1";
+    SqliteWrapper::Options options;
+    SqliteWrapper::PrewarmProgress progress;
+    SqliteWrapper::IoStats io;
+    int64_t count = -1;
+    std::atomic<int> reports{0};
+
+    SqliteWrapper::TableSchema schema;
+    SqliteWrapper::TableSchema::Index idx;
+
+    schema.name = table_name;
+    schema.columns = {
+        {"num1", SqliteWrapper::COL_INTEGER, false, ""},
+        {"str1", SqliteWrapper::COL_TEXT, false, ""},
+    };
+    idx.name = "idx_num1";
+    idx.columns = {"num1"};
+    schema.indexes = {idx};
+    ASSERT_EQ(0, sw->create_table(schema));
+    {
+        SqliteWrapper::Transaction tx(*sw);
+        for (int i = 0; i < 2000; i++)
+            ASSERT_EQ(0, tx.insert_entry(table_name, "(num1, str1) VALUES (" +
+                        std::to_string(i) + ", '" + std::string(100, 'x') +
+                        "')"));
+        ASSERT_EQ(0, tx.commit());
+    }
+    delete sw;
+
+    //database reads of scans over the table and the index
+    auto scan_reads = [&]() {
+        sw->reset_io_stats();
+        EXPECT_EQ(0, sw->count_entries(count, table_name,
+                    "NOT INDEXED WHERE str1 != ''"));
+        EXPECT_EQ(2000, count);
+        EXPECT_EQ(0, sw->count_entries(count, table_name, "WHERE num1 >= 0"));
+        EXPECT_EQ(2000, count);
+        EXPECT_EQ(0, sw->get_io_stats(io));
+        return io.counters[SqliteWrapper::OP_COUNT_ENTRIES]
+            [SqliteWrapper::IO_FILE_DB].reads;
+    };
+    options.io_stats = true;
+    sw = new SqliteWrapper(db_file_path, options);
+    uint64_t cold_reads = scan_reads();
+    ASSERT_EQ(-ENOENT, sw->get_prewarm_progress(progress));
+    delete sw;
+
+    //warmed up by the constructor, the scans then only check the header
+    options.prewarm = {table_name, "idx_num1"};
+    sw = new SqliteWrapper(db_file_path, options);
+    ASSERT_TRUE(sw->is_ok());
+    ASSERT_EQ(0, sw->get_prewarm_progress(progress));
+    ASSERT_TRUE(progress.done);
+    ASSERT_EQ(0, progress.result);
+    ASSERT_EQ(2u, progress.objects);
+    ASSERT_EQ(2u, progress.objects_done);
+    ASSERT_GT(progress.pages, 2000 * 100 / 4096);
+    ASSERT_LT(scan_reads() * 10, cold_reads);
+
+    //in the background
+    ASSERT_EQ(0, sw->start_prewarm({table_name}, false,
+                [&](const SqliteWrapper::PrewarmProgress &p) {
+                    reports++;
+                    if (p.done) {
+                        ASSERT_EQ(1u, p.objects_done);
+                    }
+                }));
+    ASSERT_EQ(0, sw->wait_prewarm());
+    ASSERT_EQ(2, reports.load());
+    ASSERT_EQ(-ENOENT, sw->prewarm({"nope"}));
+    ASSERT_EQ(0, sw->get_prewarm_progress(progress));
+    ASSERT_EQ(-ENOENT, progress.result);
+    delete sw;
+
+    options = SqliteWrapper::Options();
+    options.lock_policy = SqliteWrapper::LOCK_NONE;
+    sw = new SqliteWrapper(db_file_path, options);
+    ASSERT_EQ(-EINVAL, sw->start_prewarm({table_name}));
+    ASSERT_EQ(0, sw->prewarm({table_name}));
+}
 //place holder
 /*
 TEST_F(TestSqliteWrapper, test_dummy)
@@ -0,0 +1,351 @@
+/*
+ * sqlite_wrapper_replay: replay a wrapper trace against a database
+ *
+ * usage: sqlite_wrapper_replay [-m] [-t threads] <trace> <db>
+ *
+ *  -m: replay at maximum speed instead of the recorded pace
+ *  -t: number of replay threads, the recorded threads are spread over them
+ *      (default: one replay thread per recorded thread)
+ *
+ * Calls of a recorded thread keep their order. Blobs are synthesized from
+ * their recorded size and hash, equal blobs stay equal. Throughput and
+ * latency percentiles are reported once the whole trace is replayed.
+ */
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+#include <memory>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sqlite_wrapper.h"
+
+typedef std::chrono::steady_clock replay_clock;
+
+static const char *method_names[TRACE_METHOD_MAX] = {
+    "", "create_table", "peek_entry", "insert_entry", "update_entry",
+    "insert_update_entry", "delete_entry", "delete_all_entry", "get_entry",
+    "enable_blob_dedup", "tx_begin", "tx_commit", "tx_rollback",
+    "count_entries", "exists", "aggregate"
+};
+
+//number of sql parts expected, table name included
+static const size_t method_args[TRACE_METHOD_MAX] = {
+    0, 2, 2, 2, 3, 4, 2, 1, 3, 0, 0, 0, 0, 2, 2, 3
+};
+
+struct Sample {
+    uint8_t method;
+    uint64_t ns;
+};
+
+struct Stream {
+    std::vector<const TraceRecord *> records;
+    size_t pos = 0;
+    std::vector<std::unique_ptr<SqliteWrapper::Transaction>> txs;
+};
+
+struct Worker {
+    std::vector<Stream> streams;
+    std::vector<Sample> samples;
+    uint64_t errors = 0;        // calls not replayable
+    uint64_t mismatches = 0;    // result differs from the recorded one
+};
+
+static void synthesize_blob(const TraceBlob &blob, std::vector<uint8_t> &buf)
+{
+    uint64_t x = blob.hash | 1;
+
+    buf.resize(blob.size);
+    for (auto &byte : buf) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        byte = (uint8_t)x;
+    }
+}
+
+static int replay_record(SqliteWrapper &sw, Stream &stream,
+        const TraceRecord &rec,
+        std::map<const std::string, std::vector<uint8_t>*> *blobs,
+        int &ret)
+{
+    auto tx = stream.txs.empty() ? nullptr : stream.txs.back().get();
+    auto const &a = rec.args;
+    std::vector<SqliteWrapper::GetItem> out;
+    SqliteWrapper::Value value;
+    int64_t scratch;
+    auto discard = [](const void *src, uint32_t size) {
+        (void)src;
+        (void)size;
+        return 0;
+    };
+
+    switch (rec.method) {
+        case TRACE_CREATE_TABLE:
+            ret = sw.create_table(a[0], a[1]);
+            break;
+        case TRACE_PEEK_ENTRY:
+            ret = tx ? tx->peek_entry(a[0], a[1]) : sw.peek_entry(a[0], a[1]);
+            break;
+        case TRACE_INSERT_ENTRY:
+            ret = tx ? tx->insert_entry(a[0], a[1], blobs) :
+                sw.insert_entry(a[0], a[1], blobs);
+            break;
+        case TRACE_UPDATE_ENTRY:
+            ret = tx ? tx->update_entry(a[0], a[1], a[2], blobs) :
+                sw.update_entry(a[0], a[1], a[2], blobs);
+            break;
+        case TRACE_INSERT_UPDATE_ENTRY:
+            ret = tx ? tx->insert_update_entry(a[0], a[1], a[2], a[3], blobs) :
+                sw.insert_update_entry(a[0], a[1], a[2], a[3], blobs);
+            break;
+        case TRACE_DELETE_ENTRY:
+            ret = tx ? tx->delete_entry(a[0], a[1]) :
+                sw.delete_entry(a[0], a[1]);
+            break;
+        case TRACE_DELETE_ALL_ENTRY:
+            ret = tx ? tx->delete_all_entry(a[0]) : sw.delete_all_entry(a[0]);
+            break;
+        case TRACE_GET_ENTRY:
+            for (uint32_t i = 0; i < rec.aux; i++)
+                out.emplace_back(&scratch, sizeof(scratch), discard);
+            ret = tx ? tx->get_entry(out, a[0], a[1], a[2]) :
+                sw.get_entry(out, a[0], a[1], a[2]);
+            break;
+        case TRACE_COUNT_ENTRIES:
+            ret = tx ? tx->count_entries(scratch, a[0], a[1]) :
+                sw.count_entries(scratch, a[0], a[1]);
+            break;
+        case TRACE_EXISTS:
+            ret = tx ? tx->exists(a[0], a[1]) : sw.exists(a[0], a[1]);
+            break;
+        case TRACE_AGGREGATE:
+            if (rec.aux >= SqliteWrapper::AGG_MAX_FN)
+                return -EINVAL;
+            ret = tx ? tx->aggregate(value, a[0],
+                    (SqliteWrapper::AggregateFn)rec.aux, a[1], a[2]) :
+                sw.aggregate(value, a[0], (SqliteWrapper::AggregateFn)rec.aux,
+                        a[1], a[2]);
+            break;
+        case TRACE_ENABLE_BLOB_DEDUP:
+            ret = sw.enable_blob_dedup();
+            break;
+        case TRACE_TX_BEGIN:
+            if (rec.aux == 0 && tx == nullptr)
+                stream.txs.emplace_back(new SqliteWrapper::Transaction(sw));
+            else if (rec.aux != 0 && tx != nullptr)
+                stream.txs.emplace_back(new SqliteWrapper::Transaction(*tx));
+            else
+                return -EINVAL;
+            ret = stream.txs.back()->is_ok() ? 0 : -EAGAIN;
+            break;
+        case TRACE_TX_COMMIT:
+        case TRACE_TX_ROLLBACK:
+            if (tx == nullptr)
+                return -EINVAL;
+            ret = rec.method == TRACE_TX_COMMIT ? tx->commit() :
+                tx->rollback();
+            //a failed end keeps the transaction open, its result differs
+            //from the recorded one unless the recorded end failed too
+            if (!tx->is_ok())
+                stream.txs.pop_back();
+            break;
+        default:
+            return -EINVAL;
+    }
+    return 0;
+}
+
+static void replay_worker(SqliteWrapper &sw, Worker &worker, bool max_speed,
+        replay_clock::time_point start)
+{
+    std::map<const std::string, std::vector<uint8_t>*> blobs;
+    std::vector<std::vector<uint8_t>> blob_bufs;
+
+    while (true) {
+        Stream *stream = nullptr;
+
+        //a stream inside a transaction owns the connection, finish it first
+        for (auto &s : worker.streams) {
+            if (s.pos == s.records.size()) {
+                //transactions left open by the trace roll back as soon as
+                //their stream ends, they hold the connection
+                while (!s.txs.empty())
+                    s.txs.pop_back();
+                continue;
+            }
+            if (!s.txs.empty()) {
+                stream = &s;
+                break;
+            }
+            if (stream == nullptr ||
+                    s.records[s.pos]->ts_ns <
+                    stream->records[stream->pos]->ts_ns)
+                stream = &s;
+        }
+        if (stream == nullptr)
+            break;
+
+        auto const &rec = *stream->records[stream->pos++];
+        int ret = 0;
+
+        blobs.clear();
+        blob_bufs.resize(rec.blobs.size());
+        for (size_t i = 0; i < rec.blobs.size(); i++) {
+            synthesize_blob(rec.blobs[i], blob_bufs[i]);
+            blobs[rec.blobs[i].name] = &blob_bufs[i];
+        }
+        if (!max_speed)
+            std::this_thread::sleep_until(start +
+                    std::chrono::nanoseconds(rec.ts_ns));
+
+        auto t0 = replay_clock::now();
+        if (replay_record(sw, *stream, rec, blobs.empty() ? nullptr : &blobs,
+                    ret) != 0) {
+            worker.errors++;
+            continue;
+        }
+        auto t1 = replay_clock::now();
+
+        worker.samples.push_back(Sample{rec.method, (uint64_t)
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        t1 - t0).count()});
+        if (rec.method == TRACE_PEEK_ENTRY ? (ret != 0) != (rec.result != 0) :
+                ret != rec.result)
+            worker.mismatches++;
+    }
+}
+
+static double percentile_us(const std::vector<uint64_t> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t idx = (size_t)(p / 100.0 * (sorted.size() - 1) + 0.5);
+    return sorted[idx] / 1000.0;
+}
+
+static void report(const char *name, std::vector<uint64_t> &ns)
+{
+    std::sort(ns.begin(), ns.end());
+    printf("%-20s %10zu %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+            ns.size(), percentile_us(ns, 50), percentile_us(ns, 90),
+            percentile_us(ns, 99), percentile_us(ns, 99.9),
+            ns.empty() ? 0.0 : ns.back() / 1000.0);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-m] [-t threads] <trace> <db>\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<TraceRecord> records;
+    TraceReader reader;
+    bool max_speed = false;
+    size_t nthreads = 0;
+    uint32_t nstreams = 0;
+    int opt;
+    int ret;
+
+    while ((opt = getopt(argc, argv, "mt:")) != -1) {
+        switch (opt) {
+            case 'm':
+                max_speed = true;
+                break;
+            case 't':
+                nthreads = strtoul(optarg, nullptr, 10);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if ((ret = reader.open(argv[optind])) != 0) {
+        fprintf(stderr, "can't open trace %s: %s\n", argv[optind],
+                strerror(-ret));
+        return 1;
+    }
+    while (true) {
+        TraceRecord rec;
+
+        if ((ret = reader.read(rec)) == -ENOENT)
+            break;
+        if (ret != 0) {
+            fprintf(stderr, "corrupted trace after %zu records\n",
+                    records.size());
+            return 1;
+        }
+        if (rec.args.size() != method_args[rec.method]) {
+            fprintf(stderr, "unexpected %s record, skipped\n",
+                    method_names[rec.method]);
+            continue;
+        }
+        nstreams = std::max(nstreams, rec.thread + 1);
+        records.push_back(std::move(rec));
+    }
+
+    SqliteWrapper sw(argv[optind + 1]);
+    if (!sw.is_ok()) {
+        fprintf(stderr, "can't open database %s\n", argv[optind + 1]);
+        return 1;
+    }
+
+    if (nthreads == 0)
+        nthreads = std::max(nstreams, 1u);
+    std::vector<Worker> workers(nthreads);
+    std::vector<Stream *> streams(nstreams);
+    for (uint32_t t = 0; t < nstreams; t++) {
+        auto &worker = workers[t % nthreads];
+        worker.streams.emplace_back();
+    }
+    for (uint32_t t = 0; t < nstreams; t++)
+        streams[t] = &workers[t % nthreads].streams[t / nthreads];
+    for (auto const &rec : records)
+        streams[rec.thread]->records.push_back(&rec);
+
+    auto start = replay_clock::now();
+    std::vector<std::thread> threads;
+    for (auto &worker : workers)
+        threads.emplace_back(replay_worker, std::ref(sw), std::ref(worker),
+                max_speed, start);
+    for (auto &thread : threads)
+        thread.join();
+    double elapsed = std::chrono::duration<double>(
+            replay_clock::now() - start).count();
+
+    std::vector<uint64_t> all;
+    std::vector<std::vector<uint64_t>> per_method(TRACE_METHOD_MAX);
+    uint64_t errors = 0;
+    uint64_t mismatches = 0;
+    for (auto const &worker : workers) {
+        for (auto const &sample : worker.samples) {
+            all.push_back(sample.ns);
+            per_method[sample.method].push_back(sample.ns);
+        }
+        errors += worker.errors;
+        mismatches += worker.mismatches;
+    }
+
+    printf("replayed %zu calls in %.3f s with %zu threads (%s speed): "
+            "%.0f calls/s\n", all.size(), elapsed, nthreads,
+            max_speed ? "max" : "recorded",
+            elapsed > 0 ? all.size() / elapsed : 0.0);
+    printf("skipped %llu calls, %llu results differ from the trace\n",
+            (unsigned long long)errors, (unsigned long long)mismatches);
+    printf("%-20s %10s %10s %10s %10s %10s %10s\n", "latency (us)", "calls",
+            "p50", "p90", "p99", "p99.9", "max");
+    for (int m = 1; m < TRACE_METHOD_MAX; m++) {
+        if (!per_method[m].empty())
+            report(method_names[m], per_method[m]);
+    }
+    report("all", all);
+    return 0;
+}